@@ -0,0 +1,363 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "icache.h"
+#include "vm16.h"
+
+/* Flags of a word, also written to the generated program */
+#define CODE   0x1 /* The word is reachable as an instruction */
+#define LEADER 0x2 /* The word starts a basic block */
+
+struct aot {
+	uint16_t mm[VM16_MM_SIZE];   /* Main memory with the image loaded */
+	uint8_t flag[VM16_MM_SIZE];  /* CODE and LEADER flags */
+	uint16_t work[VM16_MM_SIZE]; /* Leaders left to walk */
+	size_t nwork;
+	uint16_t end;                /* First word after the image */
+};
+
+/* Names of the registers in the generated program */
+static char const *rn[8] = {"0", "r1", "r2", "r3", "r4", "r5", "r6", "r7"};
+
+/* Definitions shared by every generated program */
+static char const *prologue[] = {
+	"/* Set once a translated word has been written */",
+	"static int smc;",
+	"",
+	"/* Store a word, returns 1 when the machine halts */",
+	"static int",
+	"store(uint16_t a, uint16_t w)",
+	"{",
+	"\t/* Devices: 0x0000 halts, 0x0001 is stdout and 0x0003 flushes it */",
+	"\tif (a == 0x0000) {",
+	"\t\treturn 1;",
+	"\t}",
+	"\tif (a == 0x0001) {",
+	"\t\tif (w != 0) {",
+	"\t\t\tputc(w, stdout);",
+	"\t\t}",
+	"\t\treturn 0;",
+	"\t}",
+	"\tif (a == 0x0003) {",
+	"\t\tfflush(stdout);",
+	"\t\treturn 0;",
+	"\t}",
+	"\tmm[a] = w;",
+	"\tif (code[a]) {",
+	"\t\tsmc = 1;",
+	"\t}",
+	"\treturn 0;",
+	"}",
+	"",
+	"/* Load a word, 0x0002 reads stdin */",
+	"static uint16_t",
+	"load(uint16_t a)",
+	"{",
+	"\tint c;",
+	"",
+	"\tif (a == 0x0002) {",
+	"\t\tc = getchar();",
+	"\t\treturn c == EOF ? 0xffff : c;",
+	"\t}",
+	"\treturn mm[a];",
+	"}",
+	"",
+	"/* Interpret from pc until reaching translated code or halting */",
+	"static uint16_t",
+	"interp(uint16_t *r, uint16_t pc)",
+	"{",
+	"\tuint16_t ir, rd, r1, r2, im7;",
+	"",
+	"\twhile (pc != 0x0000 && (smc || !(code[pc] & 0x2))) {",
+	"\t\tir = mm[pc];",
+	"\t\tpc = (pc + 1) & 0x7fff;",
+	"\t\trd = (ir & 0x0038) >> 3;",
+	"\t\tr1 = (ir & 0x01c0) >> 6;",
+	"\t\tr2 = (ir & 0xe000) >> 13;",
+	"\t\tim7 = (ir & 0xfe00) >> 9;",
+	"\t\tim7 |= im7 & 0x40 ? 0xff80 : 0x0000;",
+	"\t\tswitch (ir & 0x7) {",
+	"\t\tcase 0: r[rd] = ir & 0xffc0; break;",
+	"\t\tcase 1: r[rd] = pc + (ir & 0xffc0); break;",
+	"\t\tcase 2:",
+	"\t\t\tif (rd) {",
+	"\t\t\t\tr[rd] = pc + 1;",
+	"\t\t\t}",
+	"\t\t\tpc = (r[r1] + im7) & 0x7fff;",
+	"\t\t\tbreak;",
+	"\t\tcase 3: pc = (pc + (r[rd] == r[r1] ? im7 : 0)) & 0x7fff; break;",
+	"\t\tcase 4: r[rd] = load((r[r1] + im7) & 0x7fff); break;",
+	"\t\tcase 5:",
+	"\t\t\tif (store((r[r1] + im7) & 0x7fff, r[rd])) {",
+	"\t\t\t\treturn 0x0000;",
+	"\t\t\t}",
+	"\t\t\tbreak;",
+	"\t\tcase 6: r[rd] = r[r1] + im7; break;",
+	"\t\tcase 7:",
+	"\t\t\tswitch ((ir & 0x1e00) >> 9) {",
+	"\t\t\tcase 0: r[rd] = r[r1] + r[r2]; break;",
+	"\t\t\tcase 1: r[rd] = r[r1] - r[r2]; break;",
+	"\t\t\tcase 2: r[rd] = (unsigned)r[r1] << (r[r2] & 31); break;",
+	"\t\t\tcase 3: r[rd] = r[r1] >> (r[r2] & 31); break;",
+	"\t\t\tcase 4: r[rd] = ~(r[r1] & r[r2]); break;",
+	"\t\t\tcase 5: r[rd] = r[r1] & r[r2]; break;",
+	"\t\t\tcase 6: r[rd] = r[r1] | r[r2]; break;",
+	"\t\t\tcase 7: r[rd] = r[r1] < r[r2]; break;",
+	"\t\t\t}",
+	"\t\t}",
+	"\t\tr[0] = 0;",
+	"\t}",
+	"\treturn pc;",
+	"}",
+	"",
+	"/* Store and leave translated code once it may have been rewritten */",
+	"#define STORE(a, w, next) do { \\",
+	"\tif (store((a), (w))) { \\",
+	"\t\tgoto halt; \\",
+	"\t} \\",
+	"\tif (smc) { \\",
+	"\t\tpc = (next); \\",
+	"\t\tgoto fallback; \\",
+	"\t} \\",
+	"} while (0)",
+	"",
+	"int",
+	"main(void)",
+	"{",
+	"\tuint16_t r1 = 0, r2 = 0, r3 = 0, r4 = 0, r5 = 0, r6 = 0, r7 = 0;",
+	"\tuint16_t r[8], pc = 0x0010;",
+	"",
+	NULL,
+};
+
+/* Mark a basic block to be walked */
+static void
+root(struct aot *s, uint16_t a)
+{
+	if (a < VM16_ADDR_START || a >= s->end) {
+		return;
+	}
+	if (!(s->flag[a] & LEADER)) {
+		s->flag[a] |= LEADER;
+		s->work[s->nwork++] = a;
+	}
+}
+
+/*
+ * Mark the instructions reachable from a leader. Constants tracked through
+ * the block resolve the targets of JALRs following an li or la.
+ */
+static void
+walk(struct aot *s, uint16_t a)
+{
+	struct vm16_insn in;
+	uint16_t next, val[8] = {0};
+	uint8_t known = 0x1;
+
+	while (a >= VM16_ADDR_START && a < s->end && !(s->flag[a] & CODE)) {
+		s->flag[a] |= CODE;
+		icache_decode(&in, s->mm[a]);
+		next = VM16_ADDR(a + 1);
+		switch (in.op) {
+		case IC_LUI:
+			val[in.rd] = in.im;
+			known |= 1 << in.rd;
+			break;
+		case IC_AUIPC:
+			val[in.rd] = next + in.im;
+			known |= 1 << in.rd;
+			break;
+		case IC_ADDI:
+			val[in.rd] = val[in.r1] + in.im;
+			known = (known & ~(1 << in.rd)) | ((known >> in.r1 & 1) << in.rd);
+			break;
+		case IC_BEQ:
+			root(s, VM16_ADDR(next + in.im));
+			root(s, next);
+			return;
+		case IC_JMP:
+			root(s, VM16_ADDR(next + in.im));
+			return;
+		case IC_JALR:
+			if (in.rd) {
+				val[in.rd] = next + 1;
+				known |= 1 << in.rd;
+				root(s, next + 1);
+			}
+			if (known >> in.r1 & 1) {
+				root(s, VM16_ADDR(val[in.r1] + in.im));
+			}
+			return;
+		case IC_NOP:
+		case IC_SW:
+			break;
+		default:
+			known &= ~(1 << in.rd);
+			break;
+		}
+		known |= 0x1;
+		a = next;
+	}
+}
+
+/* Transfer control to a guest address known at translation time */
+static void
+branch(struct aot *s, FILE *out, uint16_t a)
+{
+	if (a == VM16_ADDR_HALT) {
+		fprintf(out, "goto halt;\n");
+	} else if ((s->flag[a] & (CODE | LEADER)) == (CODE | LEADER)) {
+		fprintf(out, "goto L%04x;\n", a);
+	} else {
+		fprintf(out, "{ pc = 0x%04x; goto dispatch; }\n", a);
+	}
+}
+
+/* Translate the instruction at a, return whether it can fall through */
+static bool
+insn(struct aot *s, FILE *out, uint16_t a)
+{
+	static char const *math[] = {
+		"%s = %s + %s;", "%s = %s - %s;",
+		"%s = (unsigned)%s << (%s & 31);", "%s = %s >> (%s & 31);",
+		"%s = ~(%s & %s);", "%s = %s & %s;", "%s = %s | %s;",
+		"%s = %s < %s;",
+	};
+	struct vm16_insn in;
+	uint16_t next = VM16_ADDR(a + 1);
+
+	icache_decode(&in, s->mm[a]);
+	fprintf(out, "\t/* %04x: %04x */\n", a, in.ir);
+	switch (in.op) {
+	case IC_LUI:
+		fprintf(out, "\t%s = 0x%04x;\n", rn[in.rd], in.im);
+		break;
+	case IC_AUIPC:
+		fprintf(out, "\t%s = 0x%04x;\n", rn[in.rd], (uint16_t)(next + in.im));
+		break;
+	case IC_JALR:
+		if (in.rd) {
+			fprintf(out, "\t%s = 0x%04x;\n", rn[in.rd], (uint16_t)(next + 1));
+		}
+		fprintf(out, "\tpc = (%s + 0x%04x) & 0x7fff;\n", rn[in.r1], in.im);
+		fprintf(out, "\tgoto dispatch;\n");
+		return false;
+	case IC_BEQ:
+		fprintf(out, "\tif (%s == %s) ", rn[in.rd], rn[in.r1]);
+		branch(s, out, VM16_ADDR(next + in.im));
+		break;
+	case IC_JMP:
+		fprintf(out, "\t");
+		branch(s, out, VM16_ADDR(next + in.im));
+		return false;
+	case IC_LW:
+		if (in.rd) {
+			fprintf(out, "\t%s = load((%s + 0x%04x) & 0x7fff);\n",
+			        rn[in.rd], rn[in.r1], in.im);
+		} else {
+			fprintf(out, "\tload((%s + 0x%04x) & 0x7fff);\n",
+			        rn[in.r1], in.im);
+		}
+		break;
+	case IC_SW:
+		fprintf(out, "\tSTORE((%s + 0x%04x) & 0x7fff, %s, 0x%04x);\n",
+		        rn[in.r1], in.im, rn[in.rd], next);
+		break;
+	case IC_ADDI:
+		fprintf(out, "\t%s = %s + 0x%04x;\n", rn[in.rd], rn[in.r1], in.im);
+		break;
+	case IC_NOP:
+		break;
+	default:
+		fprintf(out, "\t");
+		fprintf(out, math[in.op - IC_ADD], rn[in.rd], rn[in.r1], rn[in.r2]);
+		fprintf(out, "\n");
+		break;
+	}
+	return true;
+}
+
+bool
+aot_emit(FILE *out, char const *name, uint16_t const *words, size_t nwords)
+{
+	struct aot *s;
+	size_t i, n;
+	uint16_t a;
+
+	if (VM16_ADDR_START + nwords >= VM16_MM_SIZE) {
+		return false;
+	}
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		return false;
+	}
+	memcpy(&s->mm[VM16_ADDR_START], words, sizeof(*words) * nwords);
+	s->end = VM16_ADDR_START + nwords;
+	root(s, VM16_ADDR_START);
+	while (s->nwork)
+		walk(s, s->work[--s->nwork]);
+
+	fprintf(out, "/* Generated by vm16 -c from %s */\n", name);
+	fprintf(out, "#include <stdint.h>\n#include <stdio.h>\n\n");
+	fprintf(out, "static uint16_t mm[0x%x] = {", VM16_MM_SIZE);
+	for (a = VM16_ADDR_START, n = 0; a < s->end; ++a) {
+		if (s->mm[a])
+			fprintf(out, "%s[0x%04x] = 0x%04x,", n++ % 4 ? " " : "\n\t", a, s->mm[a]);
+	}
+	fprintf(out, "\n};\n\n");
+	fprintf(out, "/* Translated words, 0x2 marks the start of a basic block */\n");
+	fprintf(out, "static unsigned char const code[0x%x] = {", VM16_MM_SIZE);
+	for (a = VM16_ADDR_START, n = 0; a < s->end; ++a) {
+		if (s->flag[a] & CODE)
+			fprintf(out, "%s[0x%04x] = %d,", n++ % 6 ? " " : "\n\t", a, s->flag[a]);
+	}
+	fprintf(out, "\n};\n\n");
+	for (i = 0; prologue[i]; ++i)
+		fprintf(out, "%s\n", prologue[i]);
+
+	/* Translated code, basic blocks in address order */
+	fprintf(out, "\tgoto dispatch;\n");
+	for (a = VM16_ADDR_START; a < s->end; ++a) {
+		if (!(s->flag[a] & CODE)) {
+			continue;
+		}
+		if (s->flag[a] & LEADER) {
+			fprintf(out, "L%04x:\n", a);
+		}
+		/* Continue at the next word when it has not been translated */
+		if (insn(s, out, a) && !(s->flag[VM16_ADDR(a + 1)] & CODE)) {
+			fprintf(out, "\t");
+			branch(s, out, VM16_ADDR(a + 1));
+		}
+	}
+
+	/* Computed jumps land on a block or in the interpreter */
+	fprintf(out, "dispatch:\n");
+	fprintf(out, "\tif (smc && pc != 0x0000) {\n\t\tgoto fallback;\n\t}\n");
+	fprintf(out, "\tswitch (pc) {\n");
+	fprintf(out, "\tcase 0x0000: goto halt;\n");
+	for (a = VM16_ADDR_START; a < s->end; ++a) {
+		if (s->flag[a] & LEADER)
+			fprintf(out, "\tcase 0x%04x: goto L%04x;\n", a, a);
+	}
+	fprintf(out, "\tdefault: goto fallback;\n");
+	fprintf(out, "\t}\n");
+	fprintf(out, "fallback:\n");
+	fprintf(out, "\tr[0] = 0;\n");
+	for (i = 1; i < 8; ++i)
+		fprintf(out, "\tr[%zu] = r%zu;\n", i, i);
+	fprintf(out, "\tpc = interp(r, pc);\n");
+	for (i = 1; i < 8; ++i)
+		fprintf(out, "\tr%zu = r[%zu];\n", i, i);
+	fprintf(out, "\tgoto dispatch;\n");
+	fprintf(out, "halt:\n");
+	fprintf(out, "\treturn 0;\n");
+	fprintf(out, "}\n");
+	free(s);
+	return !ferror(out);
+}
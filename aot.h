@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details */
+#ifndef AOT_H__
+#define AOT_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "vm16.h"
+
+/*
+ * Translate an assembled image loaded at VM16_ADDR_START into a C program
+ * that behaves like the machine running it. Returns false on write errors.
+ */
+bool
+aot_emit(FILE *out, char const *name, uint16_t const *words, size_t nwords);
+
+#endif
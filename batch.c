@@ -0,0 +1,465 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "gen.h"
+#include "log.h"
+#include "pool.h"
+#include "simd.h"
+#include "sink.h"
+#include "source.h"
+#include "txt.h"
+#include "vm16.h"
+
+struct worker {
+	pthread_t tid;
+	pthread_mutex_t lock;                /* Guards head and tail */
+	size_t head;                         /* Next unit of the worker */
+	size_t tail;                         /* End of the units left to it */
+	struct batch *b;                     /* Batch the worker belongs to */
+	struct vm16x *x;                     /* Lockstep machine, or NULL */
+	FILE *fp[VM16X_LANES];               /* Inputs of the jobs running */
+	struct sink sink[VM16X_LANES];       /* Capture the output of jobs */
+	struct source source[VM16X_LANES];   /* Feed the input of jobs */
+};
+
+/* Units of work are runs of order, unit k spans order[unit[k]..unit[k+1]) */
+struct batch {
+	struct batch_job *jobs;
+	size_t *order;
+	size_t *unit;
+	struct worker *workers;
+	size_t nworkers;
+	void (*exec)(struct vm16 *);
+	int (*run)(struct vm16 *, uint64_t);
+	uint64_t budget;     /* Instructions each job may run, 0 for no limit */
+	struct pool *pools;  /* Machines for each distinct image */
+	size_t npools;
+	size_t *pool;        /* Pool of each job */
+};
+
+/* Read a whole file into a NUL terminated buffer */
+static char *
+slurp(char const *path)
+{
+	FILE *fp = fopen(path, "r");
+	char *buf = NULL;
+	long len;
+
+	if (!fp) {
+		return NULL;
+	}
+	if (!fseek(fp, 0, SEEK_END) && (len = ftell(fp)) >= 0) {
+		rewind(fp);
+		buf = malloc(len + 1);
+		if (buf) {
+			buf[fread(buf, 1, len, fp)] = '\0';
+		}
+	}
+	fclose(fp);
+	return buf;
+}
+
+/* Assemble the image of a job unless an earlier job has the same one */
+static bool
+prepare(struct batch_job *jobs, size_t i, char const *cache)
+{
+	static uint16_t out[VM16_MM_SIZE];
+	struct txt in;
+	size_t k;
+
+	for (k = 0; k < i; ++k) {
+		if (!strcmp(jobs[k].image, jobs[i].image)) {
+			jobs[i].words = jobs[k].words;
+			jobs[i].nwords = jobs[k].nwords;
+			return true;
+		}
+	}
+	if (cache) {
+		jobs[i].nwords = cache_assemble(cache, jobs[i].image, out);
+	} else {
+		if (!txt_open(&in, jobs[i].image)) {
+			log_error("Unable to read '%s'\n", jobs[i].image);
+			return false;
+		}
+		jobs[i].nwords = assemble(&in, out);
+		/* Jobs only need the words, labels are not looked at again */
+		txt_close(&in);
+	}
+	jobs[i].words = malloc(sizeof(*out) * (jobs[i].nwords + 1));
+	if (jobs[i].words) {
+		memcpy(jobs[i].words, out, sizeof(*out) * jobs[i].nwords);
+	}
+	return jobs[i].words != NULL;
+}
+
+static char *
+copy(char const *s)
+{
+	char *d = s ? malloc(strlen(s) + 1) : NULL;
+
+	return d ? strcpy(d, s) : NULL;
+}
+
+bool
+batch_load(char const *path, char const *cache, struct batch_job **out,
+           size_t *njobs)
+{
+	struct batch_job *jobs = NULL, *tmp;
+	size_t n = 0, cap = 0;
+	char *text, *line, *next, *f[3];
+	int nf;
+
+	text = slurp(path);
+	if (!text) {
+		log_error("Unable to read '%s'\n", path);
+		return false;
+	}
+	for (line = text; line; line = next) {
+		next = strchr(line, '\n');
+		if (next) {
+			*next++ = '\0';
+		}
+		for (nf = 0; nf < 3 && (f[nf] = strtok(nf ? NULL : line, " \t\r")); ++nf)
+			;
+		if (!nf || f[0][0] == '#') {
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			tmp = realloc(jobs, sizeof(*jobs) * cap);
+			if (!tmp) {
+				goto fail;
+			}
+			jobs = tmp;
+		}
+		memset(&jobs[n], 0, sizeof(jobs[n]));
+		jobs[n].image = copy(f[0]);
+		jobs[n].input = nf > 1 && strcmp(f[1], "-") ? copy(f[1]) : NULL;
+		jobs[n].output = nf > 2 ? copy(f[2]) : NULL;
+		n += 1;
+		if (!prepare(jobs, n - 1, cache)) {
+			goto fail;
+		}
+	}
+	free(text);
+	*out = jobs;
+	*njobs = n;
+	return true;
+fail:
+	free(text);
+	batch_free(jobs, n);
+	return false;
+}
+
+/* Take the next unit of a worker, stealing one when it has none left */
+static bool
+take(struct worker *w, size_t *unit)
+{
+	struct batch *b = w->b;
+	struct worker *victim;
+	bool found = false;
+	size_t k;
+
+	for (k = 0; k < b->nworkers && !found; ++k) {
+		victim = &b->workers[(w - b->workers + k) % b->nworkers];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail) {
+			/* Owners work from the front, thieves from the back */
+			*unit = victim == w ? victim->head++ : --victim->tail;
+			found = true;
+		}
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return found;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Point the devices of a job at its input and a fresh output capture */
+static bool
+open_job(struct worker *w, size_t l, struct batch_job *job,
+         struct vm16_dev io[VM16_IO_SIZE])
+{
+	w->fp[l] = NULL;
+	if (job->input) {
+		w->fp[l] = fopen(job->input, "r");
+		if (!w->fp[l]) {
+			log_error("Unable to open '%s'\n", job->input);
+			return false;
+		}
+		source_init_file(&w->source[l], w->fp[l]);
+	} else {
+		source_init_mem(&w->source[l], "", 0);
+	}
+	sink_init_mem(&w->sink[l]);
+	sink_map(&w->sink[l], io);
+	source_map(&w->source[l], io);
+	return true;
+}
+
+/* Hand the captured output over to the job, which stopped with status */
+static void
+close_job(struct worker *w, size_t l, struct batch_job *job, double ms,
+          uint64_t steps, int status)
+{
+	sink_flush(&w->sink[l]);
+	job->out = w->sink[l].mem;
+	job->outlen = w->sink[l].memlen;
+	w->sink[l].mem = NULL;
+	job->steps = steps;
+	job->ms = ms;
+	job->stopped = status == VM16_BUDGET;
+	job->ok = status == VM16_HALTED && !w->sink[l].error &&
+	          !w->source[l].error;
+	if (w->fp[l]) {
+		fclose(w->fp[l]);
+	}
+}
+
+static void
+run(struct worker *w, size_t i)
+{
+	struct batch_job *job = &w->b->jobs[i];
+	struct pool *p = &w->b->pools[w->b->pool[i]];
+	struct vm16 *v;
+	double start;
+	int status;
+
+	v = pool_get(p);
+	if (!v) {
+		log_error("Unable to allocate a machine for '%s'\n", job->image);
+		return;
+	}
+	if (open_job(w, 0, job, v->io)) {
+		start = now();
+		/* Sources of jobs never block, one run spends the whole budget */
+		if (w->b->budget) {
+			status = w->b->run(v, w->b->budget);
+		} else {
+			w->b->exec(v);
+			status = vm16_status(v);
+		}
+		close_job(w, 0, job, now() - start, v->steps, status);
+	}
+	pool_put(p, v);
+}
+
+/* Run jobs sharing an image in lockstep, each reports the group wall time */
+static void
+run_lockstep(struct worker *w, size_t const *order, size_t n)
+{
+	struct vm16x *x = w->x;
+	struct batch_job *jobs = w->b->jobs;
+	bool open[VM16X_LANES];
+	double start, ms;
+	size_t l;
+
+	vm16x_init(x, n);
+	vm16x_load(x, jobs[order[0]].words, jobs[order[0]].nwords);
+	for (l = 0; l < n; ++l) {
+		open[l] = open_job(w, l, &jobs[order[l]], x->io[l]);
+		/* Contexts whose input is missing never start */
+		if (!open[l]) {
+			x->pc[l] = VM16_ADDR_HALT;
+		}
+	}
+	start = now();
+	vm16x_run(x, w->b->budget);
+	ms = now() - start;
+	for (l = 0; l < n; ++l) {
+		if (open[l])
+			close_job(w, l, &jobs[order[l]], ms, x->steps[l],
+			          x->status[l] == VM16_RUNNING ? VM16_HALTED : x->status[l]);
+	}
+}
+
+static void *
+work(void *arg)
+{
+	struct worker *w = arg;
+	struct batch *b = w->b;
+	size_t k;
+
+	if (!b->exec) {
+		w->x = malloc(sizeof(*w->x));
+		if (!w->x) {
+			return NULL;
+		}
+	}
+	while (take(w, &k)) {
+		if (b->exec) {
+			run(w, b->order[b->unit[k]]);
+		} else {
+			run_lockstep(w, &b->order[b->unit[k]], b->unit[k + 1] - b->unit[k]);
+		}
+	}
+	free(w->x);
+	return NULL;
+}
+
+/*
+ * Split the jobs into units. Lockstep units gather up to VM16X_LANES jobs
+ * of the same image, wherever they are in the manifest.
+ */
+static size_t
+plan(struct batch *b, size_t njobs)
+{
+	struct batch_job *jobs = b->jobs;
+	size_t i, j, n = 0, nunits = 0, lanes = b->exec ? 1 : VM16X_LANES;
+	bool *placed = calloc(njobs, sizeof(*placed));
+
+	if (!placed) {
+		return 0;
+	}
+	for (i = 0; i < njobs; ++i) {
+		if (placed[i]) {
+			continue;
+		}
+		for (j = i; j < njobs; ++j) {
+			if (placed[j] || jobs[j].words != jobs[i].words) {
+				continue;
+			}
+			if (j == i || n - b->unit[nunits - 1] == lanes) {
+				b->unit[nunits++] = n;
+			}
+			placed[j] = true;
+			b->order[n++] = j;
+			if (lanes == 1) {
+				break;
+			}
+		}
+	}
+	free(placed);
+	b->unit[nunits] = n;
+	return nunits;
+}
+
+/* Give every distinct image a pool of machines */
+static bool
+pools(struct batch *b, size_t njobs)
+{
+	struct batch_job *jobs = b->jobs;
+	size_t i, k;
+
+	for (i = 0; i < njobs; ++i) {
+		for (k = 0; k < i && jobs[k].words != jobs[i].words; ++k)
+			;
+		if (k < i) {
+			b->pool[i] = b->pool[k];
+			continue;
+		}
+		if (!pool_init(&b->pools[b->npools], jobs[i].words, jobs[i].nwords)) {
+			return false;
+		}
+		b->pool[i] = b->npools++;
+	}
+	return true;
+}
+
+bool
+batch_run(struct batch_job *jobs, size_t njobs, size_t nthreads,
+          void (*exec)(struct vm16 *), int (*run)(struct vm16 *, uint64_t),
+          uint64_t budget)
+{
+	struct batch b = {jobs, NULL, NULL, NULL, 0, exec, run, budget, NULL, 0, NULL};
+	size_t i, started = 0, nunits;
+
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	b.order = malloc(sizeof(*b.order) * (njobs + 1));
+	b.unit = calloc(njobs + 2, sizeof(*b.unit));
+	b.workers = calloc(nthreads, sizeof(*b.workers));
+	b.pools = malloc(sizeof(*b.pools) * njobs);
+	b.pool = malloc(sizeof(*b.pool) * njobs);
+	if (!b.order || !b.unit || !b.workers || !b.pools || !b.pool) {
+		goto done;
+	}
+	/* Lockstep machines load their images themselves */
+	if (exec && !pools(&b, njobs)) {
+		goto done;
+	}
+	nunits = plan(&b, njobs);
+	b.nworkers = nthreads;
+	for (i = 0; i < nthreads; ++i) {
+		pthread_mutex_init(&b.workers[i].lock, NULL);
+		b.workers[i].b = &b;
+		b.workers[i].head = nunits * i / nthreads;
+		b.workers[i].tail = nunits * (i + 1) / nthreads;
+	}
+	for (started = 0; started < nthreads; ++started) {
+		if (pthread_create(&b.workers[started].tid, NULL, work, &b.workers[started]))
+			break;
+	}
+	/* Workers that did not start have their units stolen by the others */
+	if (!started) {
+		work(&b.workers[0]);
+	}
+	for (i = 0; i < started; ++i)
+		pthread_join(b.workers[i].tid, NULL);
+	for (i = 0; i < nthreads; ++i)
+		pthread_mutex_destroy(&b.workers[i].lock);
+done:
+	for (i = 0; i < b.npools; ++i)
+		pool_fini(&b.pools[i]);
+	free(b.pool);
+	free(b.pools);
+	free(b.workers);
+	free(b.unit);
+	free(b.order);
+	return started == nthreads;
+}
+
+void
+batch_report(FILE *out, struct batch_job const *jobs, size_t njobs)
+{
+	uint64_t steps = 0;
+	double ms = 0;
+	size_t i;
+
+	fprintf(out, "%-6s %-12s %-10s %-8s %s\n", "job", "steps", "ms", "bytes", "image");
+	for (i = 0; i < njobs; ++i) {
+		fprintf(out, "%-6zu %-12llu %-10.3f %-8zu %s%s\n", i,
+		        (unsigned long long)jobs[i].steps, jobs[i].ms,
+		        jobs[i].outlen, jobs[i].image,
+		        jobs[i].stopped ? " (out of steps)" : jobs[i].ok ? "" : " (failed)");
+		steps += jobs[i].steps;
+		ms += jobs[i].ms;
+	}
+	fprintf(out, "%-6s %-12llu %-10.3f\n", "total", (unsigned long long)steps, ms);
+}
+
+void
+batch_free(struct batch_job *jobs, size_t njobs)
+{
+	size_t i, k;
+
+	for (i = 0; i < njobs; ++i) {
+		/* Images are shared with the first job that assembled them */
+		for (k = 0; k < i && jobs[k].words != jobs[i].words; ++k)
+			;
+		if (k == i) {
+			free(jobs[i].words);
+		}
+		free(jobs[i].image);
+		free(jobs[i].input);
+		free(jobs[i].output);
+		free(jobs[i].out);
+	}
+	free(jobs);
+}
@@ -0,0 +1,59 @@
+/* See LICENSE file for copyright and license details */
+#ifndef BATCH_H__
+#define BATCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vm16.h"
+
+/* One guest program run of a batch */
+struct batch_job {
+	char *image;     /* Path of the program source */
+	char *input;     /* Path of the input, or NULL for none */
+	char *output;    /* Path to write the output to, or NULL */
+	uint16_t *words; /* Assembled image, shared by jobs of the same image */
+	size_t nwords;   /* Number of words in the image */
+	char *out;       /* Captured output */
+	size_t outlen;   /* Bytes of captured output */
+	uint64_t steps;  /* Instructions executed */
+	double ms;       /* Wall time in milliseconds */
+	bool ok;         /* The job ran to completion */
+	bool stopped;    /* The job ran out of instructions before halting */
+};
+
+/*
+ * Read a manifest of jobs, one "image [input [output]]" line each, with
+ * "-" for no input. Blank lines and lines starting with '#' are skipped.
+ * Every distinct image is assembled once, or taken from the image cache
+ * in the directory cache unless it is NULL. Returns false on errors, a
+ * manifest without jobs is not one.
+ */
+bool
+batch_load(char const *path, char const *cache, struct batch_job **jobs,
+           size_t *njobs);
+
+/*
+ * Run the jobs on nthreads workers, each owning its own machine. Workers
+ * start with an even share of the jobs and steal from each other once
+ * they run out. Jobs run with exec, or with run for at most budget
+ * instructions each unless budget is 0. Without exec, jobs of the same
+ * image run together on a lockstep machine. Returns false when a worker
+ * could not be started.
+ */
+bool
+batch_run(struct batch_job *jobs, size_t njobs, size_t nthreads,
+          void (*exec)(struct vm16 *), int (*run)(struct vm16 *, uint64_t),
+          uint64_t budget);
+
+/* Write the instruction count and wall time of every job, and how it ended */
+void
+batch_report(FILE *out, struct batch_job const *jobs, size_t njobs);
+
+/* Release the jobs of a manifest */
+void
+batch_free(struct batch_job *jobs, size_t njobs);
+
+#endif
@@ -0,0 +1,125 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "gen.h"
+#include "img.h"
+#include "log.h"
+#include "txt.h"
+#include "vm16.h"
+
+static struct cache_stats stats;
+
+static void
+count(uint64_t *n)
+{
+	__atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+}
+
+/* FNV-1a over the assembler version, its options and the source bytes */
+static uint64_t
+hash(unsigned char const *p, size_t len)
+{
+	uint64_t h = 14695981039346656037u;
+	size_t i;
+
+	h = (h ^ CACHE_VERSION) * 1099511628211u;
+	h = (h ^ optimize) * 1099511628211u;
+	h = (h ^ (profile ? profile->id : 0)) * 1099511628211u;
+	for (i = 0; i < len; ++i)
+		h = (h ^ p[i]) * 1099511628211u;
+	return h;
+}
+
+/* Copy the words of a cached image, which hold a single code section */
+static size_t
+fetch(char const *name, uint16_t out[VM16_MM_SIZE])
+{
+	struct img im;
+	size_t n = 0;
+
+	if (access(name, R_OK)) {
+		return 0;
+	}
+	if (!img_open(&im, name)) {
+		count(&stats.errors);
+		return 0;
+	}
+	if (im.nsect == 1 && im.sect[0].addr == VM16_ADDR_START) {
+		n = im.sect[0].nwords;
+		memcpy(out, im.sect[0].words, sizeof(*out) * n);
+	}
+	img_close(&im);
+	return n;
+}
+
+/* Write an image under a temporary name and move it in place */
+static void
+store(char const *dir, char const *name, uint16_t const *words, size_t nwords)
+{
+	char tmp[4096 + 32];
+	FILE *fp;
+	bool ok;
+
+	mkdir(dir, 0777);
+	snprintf(tmp, sizeof(tmp), "%s.%ld", name, (long)getpid());
+	fp = fopen(tmp, "wb");
+	if (!fp) {
+		count(&stats.errors);
+		return;
+	}
+	ok = img_write(fp, words, nwords, symtab);
+	if (fclose(fp) || !ok || rename(tmp, name)) {
+		remove(tmp);
+		count(&stats.errors);
+		return;
+	}
+	count(&stats.stores);
+}
+
+size_t
+cache_assemble(char const *dir, char const *path, uint16_t out[VM16_MM_SIZE])
+{
+	char name[4096];
+	struct txt in;
+	size_t n;
+
+	if (!txt_open(&in, path)) {
+		log_fatal("Unable to open '%s'\n", path);
+	}
+	snprintf(name, sizeof(name), "%s/%016llx-%llx.img", dir,
+	         (unsigned long long)hash((unsigned char const *)in.str, in.len),
+	         (unsigned long long)in.len);
+	/* Empty images are never stored, so a miss always leaves words behind */
+	n = fetch(name, out);
+	if (n) {
+		count(&stats.hits);
+		txt_close(&in);
+		return n;
+	}
+	count(&stats.misses);
+	n = assemble(&in, out);
+	if (n) {
+		store(dir, name, out, n);
+	}
+	/* Label names are interned, only diagnostics read the source */
+	txt_close(&in);
+	return n;
+}
+
+struct cache_stats
+cache_stats(void)
+{
+	struct cache_stats s;
+
+	s.hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+	s.misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+	s.stores = __atomic_load_n(&stats.stores, __ATOMIC_RELAXED);
+	s.errors = __atomic_load_n(&stats.errors, __ATOMIC_RELAXED);
+	return s;
+}
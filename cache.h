@@ -0,0 +1,35 @@
+/* See LICENSE file for copyright and license details */
+#ifndef CACHE_H__
+#define CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm16.h"
+
+/* Bump whenever the assembler may produce other words or images change */
+#define CACHE_VERSION 2
+
+/* Lookups of the assembled image cache since the program started */
+struct cache_stats {
+	uint64_t hits;   /* Sources found assembled */
+	uint64_t misses; /* Sources assembled */
+	uint64_t stores; /* Images written to the cache */
+	uint64_t errors; /* Images that could not be read or written */
+};
+
+/*
+ * Assemble the source at path into out, unless an image of the same
+ * source bytes is stored in the directory dir. Misses store the words and
+ * labels as a binary image named after a hash of the source and
+ * CACHE_VERSION. Returns the number of words, exits on assembler errors
+ * like assemble.
+ */
+size_t
+cache_assemble(char const *dir, char const *path, uint16_t out[VM16_MM_SIZE]);
+
+/* Return the counters of every lookup so far */
+struct cache_stats
+cache_stats(void);
+
+#endif
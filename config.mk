@@ -8,8 +8,8 @@ LIBPREFIX := $(PREFIX)/lib
 MANPREFIX := $(PREFIX)/man
 
 # Linking flags
-LDFLAGS :=
+LDFLAGS := -pthread
 
 # C Compiler settings
 CC := cc
-CFLAGS := -O2 -std=c99 -Iinclude -pedantic -Wall -Wextra -g
+CFLAGS := -O2 -std=c99 -D_DEFAULT_SOURCE -pthread -Iinclude -pedantic -Wall -Wextra -g
@@ -6,23 +6,53 @@
 #include <string.h>
 
 #include "lex.h"
+#include "gen.h"
+#include "layout.h"
 #include "log.h"
+#include "obj.h"
+#include "opt.h"
+#include "prof.h"
 #include "symtab.h"
 #include "txt.h"
 #include "vm16.h"
 
-int pass = 0;
-uint16_t pc = VM16_ADDR_START;
-size_t idx = 0;
-struct symtab *symtab;
+/* A pseudo-op waiting for the address of a label */
+struct fixup {
+	size_t idx;          /* Index of the word reserved for it */
+	uint16_t opcode;     /* VM16_ADDI, VM16_LW or VM16_SW */
+	uint16_t rd;
+	struct token label;
+};
+
+/*
+ * Labels are placed as if every pseudo-op taking a label was one word.
+ * Each thread assembles on its own, so sources assemble in parallel.
+ */
+static __thread uint16_t pc = VM16_ADDR_START;
+static __thread size_t idx = 0;
+__thread struct symtab *symtab;
+
+static __thread struct fixup *fixups;
+static __thread size_t nfixups, capfixups;
+/* Every label reference is left to the linker */
+static __thread bool relocatable;
+
+bool optimize;
+__thread struct opt_stats optimized;
+struct prof const *profile;
+__thread struct layout_stats reordered;
+/* What each word was emitted for while optimizing or laying out */
+static __thread uint8_t *tags;
 
 /* Print out an assembler error message */
 static void
 err(struct txt *in, struct token const *t, char const *msg)
 {
-	size_t i;
-	fprintf(stderr, "--> %s:%zu:%zu\n", in->name, t->row, t->col);
-	char const *line = t->bytes - t->col + 1;
+	size_t i, row, col;
+
+	txt_pos(in, t->bytes, &row, &col);
+	fprintf(stderr, "--> %s:%zu:%zu\n", in->name, row, col);
+	char const *line = t->bytes - col + 1;
 
 	for (i = 0; line[i] != '\n' && line[i] != '\0'; ++i)
 		putc(line[i], stderr);
@@ -30,21 +60,51 @@ err(struct txt *in, struct token const *t, char const *msg)
 	if (!msg) {
 		return;
 	}
-	for (i = 0; i < t->col - 1; ++i)
+	for (i = 0; i < col - 1; ++i)
 		putc(' ', stderr);
 	for (i = 0; i < (t->len ? t->len : 1); ++i)
 		putc('^', stderr);
 	fprintf(stderr, " %s\n", msg);
 }
 
+/* Note what the last n words were emitted for */
+static void
+tag(uint8_t kind, size_t n)
+{
+	if (tags) {
+		memset(&tags[idx - n], kind, n);
+	}
+}
+
+/* Check that n more words fit in memory after the ones emitted */
+static void
+room(size_t n)
+{
+	if (idx + n > VM16_MM_SIZE - VM16_ADDR_START) {
+		log_fatal("Program too large\n");
+	}
+}
+
 /* Generate asmd instructions to file */
 static void
 gen(uint16_t *out, uint16_t instr)
 {
-	if (pass == 1) {
-		out[idx++] = instr;
-	}
+	room(1);
+	out[idx++] = instr;
 	pc += 1;
+	tag(OPT_CODE, 1);
+}
+
+size_t
+expand(uint16_t *out, uint16_t opcode, uint16_t rd, uint16_t addr)
+{
+	if (addr & 0xFFC0) {
+		out[0] = vm16_ori(VM16_LUI, rd, (addr & 0xFFC0) >> 6);
+		out[1] = vm16_orri(opcode, rd, rd, addr & 0x3F);
+		return 2;
+	}
+	out[0] = vm16_orri(opcode, rd, 0, addr);
+	return 1;
 }
 
 /* Parse a comma else error */
@@ -111,30 +171,16 @@ top:
 	return true;
 }
 
-static bool
-parse_label(struct txt *in, uint16_t *addr)
+/* Parse a label, its address is NULL while the label is not defined yet */
+static uint16_t const *
+parse_label(struct txt *in, struct token *tok)
 {
-	struct token tok;
-	uint16_t *tmp;
-
-	tok = lex(in);
-	if (tok.kind != TOK_IDENT) {
-		err(in, &tok, "expected label");
-		exit(-1);
-	}
-
-	if (pass == 0) {
-		*addr = 0;
-		return true;
-	}
-
-	tmp = symtab_at(symtab, &tok);
-	if (!tmp) {
-		err(in, &tok, "use of undefined label");
+	*tok = lex(in);
+	if (tok->kind != TOK_IDENT) {
+		err(in, tok, "expected label");
 		exit(-1);
 	}
-	*addr = *tmp;
-	return true;
+	return symtab_at(symtab, tok);
 }
 
 static void
@@ -180,6 +226,7 @@ asm_word(struct txt *in, uint16_t *out)
 	uint16_t word;
 	parse_number(in, 16, &word);
 	gen(out, word);
+	tag(OPT_DATA, 1);
 }
 
 static void
@@ -194,162 +241,326 @@ asm_li(struct txt *in, uint16_t *out)
 	if (im16 & 0xFFC0) {
 		gen(out, vm16_ori(VM16_LUI, rd, (im16 & 0xFFC0) >> 6));
 		gen(out, vm16_orri(VM16_ADDI, rd, rd, im16 & 0x3F));
+		tag(OPT_LI_HI, 2);
 	} else {
 		gen(out, vm16_orri(VM16_ADDI, rd, 0, im16 & 0x3F));
 	}
+	tag(OPT_LI, 1);
 }
 
+/* Load the address of a label, or the word at it, or store to it */
 static void
-asm_la(struct txt *in, uint16_t *out)
+asm_addr(struct txt *in, uint16_t *out, uint16_t opcode)
 {
-	uint16_t rd = 0, addr = 0;
+	uint16_t rd = 0;
+	uint16_t const *addr;
+	struct token tok;
+	struct fixup *tmp;
+	size_t n;
 
         parse_reg(in, &rd);
         parse_comma(in);
-        parse_label(in, &addr);
+        addr = parse_label(in, &tok);
 
-	if (addr & 0xFFC0) {
-		gen(out, vm16_ori(VM16_LUI, rd, (addr & 0xFFC0) >> 6));
-		gen(out, vm16_orri(VM16_ADDI, rd, rd, addr & 0x3F));
-	} else {
-		gen(out, vm16_orri(VM16_ADDI, rd, 0, addr));
+	pc += 1;
+	if (addr && !relocatable) {
+		room(2);
+		n = expand(&out[idx], opcode, rd, *addr);
+		idx += n;
+		tag(OPT_ADDR, n);
+		return;
+	}
+	/* Reserve a word and widen it once the label is known */
+	if (nfixups == capfixups) {
+		capfixups = capfixups ? capfixups * 2 : 256;
+		tmp = realloc(fixups, sizeof(*fixups) * capfixups);
+		if (!tmp) {
+			log_fatal("Out of memory\n");
+		}
+		fixups = tmp;
 	}
+	room(1);
+	fixups[nfixups].idx = idx++;
+	tag(OPT_ADDR, 1);
+	fixups[nfixups].opcode = opcode;
+	fixups[nfixups].rd = rd;
+	fixups[nfixups].label = tok;
+	nfixups += 1;
 }
 
+/*
+ * Patch the words reserved for forward references. Every pseudo-op that
+ * needs two words moves the code after it up by one, so the moves start
+ * from the end and each word is moved at most once.
+ */
 static void
-asm_load(struct txt *in, uint16_t *out)
+relax(struct txt *in, uint16_t *out)
 {
-	uint16_t rd = 0, addr = 0;
-
-        parse_reg(in, &rd);
-        parse_comma(in);
-        parse_label(in, &addr);
-
-	if (addr & 0xFFC0) {
-		gen(out, vm16_ori(VM16_LUI, rd, (addr & 0xFFC0) >> 6));
-		gen(out, vm16_orri(VM16_LW, rd, rd, addr & 0x3F));
-	} else {
-		gen(out, vm16_orri(VM16_LW, rd, 0, addr));
+	size_t i, end = idx, wide = 0;
+	uint16_t const *addr;
+	uint16_t w[2];
+	size_t n;
+
+	for (i = 0; i < nfixups; ++i) {
+		addr = symtab_at(symtab, &fixups[i].label);
+		if (!addr) {
+			err(in, &fixups[i].label, "use of undefined label");
+			exit(-1);
+		}
+		/* The reserved word keeps the address until it is expanded */
+		out[fixups[i].idx] = *addr;
+		wide += (*addr & 0xFFC0) != 0;
 	}
+	room(wide);
+	idx += wide;
+	for (i = nfixups; i-- > 0;) {
+		struct fixup const *f = &fixups[i];
+
+		memmove(&out[f->idx + 1 + wide], &out[f->idx + 1],
+		        sizeof(*out) * (end - f->idx - 1));
+		if (tags) {
+			memmove(&tags[f->idx + 1 + wide], &tags[f->idx + 1],
+			        end - f->idx - 1);
+		}
+		end = f->idx;
+		n = expand(w, f->opcode, f->rd, out[f->idx]);
+		wide -= n - 1;
+		memcpy(&out[f->idx + wide], w, sizeof(*w) * n);
+		if (tags) {
+			memset(&tags[f->idx + wide], OPT_ADDR, n);
+		}
+	}
+	nfixups = 0;
 }
 
+/* Assemble a whole source, leaving label references in fixups */
 static void
-asm_store(struct txt *in, uint16_t *out)
+parse(struct txt *in, uint16_t *out)
 {
-	uint16_t rd = 0, addr = 0;
+	struct token tok;
 
-        parse_reg(in, &rd);
-        parse_comma(in);
-        parse_label(in, &addr);
+	/* Only the labels of the last program are kept */
+	if (symtab) {
+		symtab_destroy(symtab);
+	}
+	symtab = symtab_create(1024);
+	if (!symtab) {
+		log_fatal("Out of memory\n");
+	}
+	idx = 0;
+	nfixups = 0;
+	pc = VM16_ADDR_START;
+	tok = lex(in);
+	while (tok.kind != TOK_EOF) {
+		if (tok.kind == TOK_IDENT) {
+			struct sym const *prev;
+			struct token def;
+			uint16_t *v;
+			size_t i;
+
+			i = symtab_find(symtab, &tok);
+			if (i < symtab->used) {
+				prev = &symtab->sym[i];
+				def.kind = TOK_IDENT;
+				def.len = prev->len;
+				def.bytes = in->str + prev->off;
+				err(in, &tok, "duplicate label");
+				err(in, &def, "previously defined here");
+				exit(-1);
+			}
+			v = symtab_getv(symtab, &tok);
+			if (!v) {
+				log_fatal("Out of memory\n");
+			}
+			*v = pc;
+			/* New labels go last, which is where find stopped */
+			symtab->sym[i].off = tok.bytes - in->str;
+			tok = lex(in);
+		}
 
-	if (addr & 0xFFC0) {
-		gen(out, vm16_ori(VM16_LUI, rd, (addr & 0xFFC0) >> 6));
-		gen(out, vm16_orri(VM16_SW, rd, rd, addr & 0x3F));
-	} else {
-		gen(out, vm16_orri(VM16_SW, rd, 0, addr));
+		switch (tok.kind) {
+		case TOK_LUI:
+			asm_ori(in, out, VM16_LUI);
+			break;
+		case TOK_AUIPC:
+			asm_ori(in, out, VM16_AUIPC);
+			break;
+		case TOK_JALR:
+			asm_orri(in, out, VM16_JALR);
+			break;
+		case TOK_BEQ:
+			asm_orri(in, out, VM16_BEQ);
+			break;
+		case TOK_LW:
+			asm_orri(in, out, VM16_LW);
+			break;
+		case TOK_SW:
+			asm_orri(in, out, VM16_SW);
+			break;
+		case TOK_ADDI:
+			asm_orri(in, out, VM16_ADDI);
+			break;
+		case TOK_ADD:
+			asm_math(in, out, VM16_ADD);
+			break;
+		case TOK_SUB:
+			asm_math(in, out, VM16_SUB);
+			break;
+		case TOK_SLL:
+			asm_math(in, out, VM16_SLL);
+			break;
+		case TOK_SRL:
+			asm_math(in, out, VM16_SRL);
+			break;
+		case TOK_NAND:
+			asm_math(in, out, VM16_NAND);
+			break;
+		case TOK_AND:
+			asm_math(in, out, VM16_AND);
+			break;
+		case TOK_OR:
+			asm_math(in, out, VM16_OR);
+			break;
+		case TOK_LT:
+			asm_math(in, out, VM16_LT);
+			break;
+		/* Directives */
+		case TOK_NOP:
+			gen(out, vm16_orri(VM16_ADDI, 0, 0, 0));
+			break;
+		case TOK_HALT:
+			gen(out, vm16_orri(VM16_JALR, 0, 0, 0));
+			break;
+		case TOK_LA:
+			asm_addr(in, out, VM16_ADDI);
+			break;
+		case TOK_LI:
+			asm_li(in, out);
+			break;
+		case TOK_LOAD:
+			asm_addr(in, out, VM16_LW);
+			break;
+		case TOK_STORE:
+			asm_addr(in, out, VM16_SW);
+			break;
+		case TOK_WORD:
+			asm_word(in, out);
+			break;
+		default:
+			err(in, &tok, "expected instruction");
+			break;
+		}
+		tok = lex(in);
 	}
 }
 
 size_t
 assemble(struct txt *in, uint16_t out[VM16_MM_SIZE])
 {
-	struct token tok;
+	relocatable = false;
+	if ((optimize || profile) && !tags) {
+		tags = malloc(VM16_MM_SIZE);
+		if (!tags) {
+			log_fatal("Out of memory\n");
+		}
+	}
+	parse(in, out);
+	relax(in, out);
+	if (optimize) {
+		idx = opt_run(out, tags, idx, symtab, &optimized);
+	}
+	/* Profiles are taken of images assembled the same way */
+	if (profile && !prof_match(profile, out, idx)) {
+		log_warn("The profile is not of '%s', left as is\n", in->name);
+	} else if (profile) {
+		idx = layout_run(out, tags, idx, symtab, profile->count, &reordered);
+	}
+	return idx;
+}
 
-	symtab = symtab_create(1024);
-	for (pass = 0; pass < 2; ++pass) {
-		pc = VM16_ADDR_START;
-		tok = lex(in);
-		while (tok.kind != TOK_EOF) {
-			if (tok.kind == TOK_IDENT) {
-				if (pass == 0) {
-					struct token const *prev;
-
-					prev = symtab_getk(symtab, &tok);
-					if (prev) {
-						err(in, &tok, "duplicate label");
-						err(in, prev, "previously defined here");
-						exit(-1);
-					}
-					*symtab_getv(symtab, &tok) = pc;
-				}
-				tok = lex(in);
-			}
+/* Copy a label into the symbols of an object, names are packed later */
+static void
+add_sym(struct obj *o, char const *name, size_t len, uint16_t value,
+        uint16_t flags)
+{
+	struct obj_sym *s = &o->sym[o->nsym++];
+
+	s->name = name;
+	s->len = len;
+	s->value = value;
+	s->flags = flags;
+}
 
-			switch (tok.kind) {
-			case TOK_LUI:
-				asm_ori(in, out, VM16_LUI);
-				break;
-			case TOK_AUIPC:
-				asm_ori(in, out, VM16_AUIPC);
-				break;
-			case TOK_JALR:
-				asm_orri(in, out, VM16_JALR);
-				break;
-			case TOK_BEQ:
-				asm_orri(in, out, VM16_BEQ);
-				break;
-			case TOK_LW:
-				asm_orri(in, out, VM16_LW);
-				break;
-			case TOK_SW:
-				asm_orri(in, out, VM16_SW);
-				break;
-			case TOK_ADDI:
-				asm_orri(in, out, VM16_ADDI);
-				break;
-			case TOK_ADD:
-				asm_math(in, out, VM16_ADD);
-				break;
-			case TOK_SUB:
-				asm_math(in, out, VM16_SUB);
-				break;
-			case TOK_SLL:
-				asm_math(in, out, VM16_SLL);
-				break;
-			case TOK_SRL:
-				asm_math(in, out, VM16_SRL);
-				break;
-			case TOK_NAND:
-				asm_math(in, out, VM16_NAND);
-				break;
-			case TOK_AND:
-				asm_math(in, out, VM16_AND);
-				break;
-			case TOK_OR:
-				asm_math(in, out, VM16_OR);
-				break;
-			case TOK_LT:
-				asm_math(in, out, VM16_LT);
-				break;
-			/* Directives */
-			case TOK_NOP:
-				gen(out, vm16_orri(VM16_ADDI, 0, 0, 0));
-				break;
-			case TOK_HALT:
-				gen(out, vm16_orri(VM16_JALR, 0, 0, 0));
-				break;
-			case TOK_LA:
-				asm_la(in, out);
-				break;
-			case TOK_LI:
-				asm_li(in, out);
-				break;
-			case TOK_LOAD:
-				asm_load(in, out);
-				break;
-			case TOK_STORE:
-				asm_store(in, out);
-				break;
-			case TOK_WORD:
-				asm_word(in, out);
-				break;
-			default:
-				err(in, &tok, "expected instruction");
-				break;
+void
+assemble_obj(struct txt *in, struct obj *o)
+{
+	struct symtab *imports;
+	struct token const *k;
+	struct sym const *s;
+	uint16_t *v;
+	size_t i, len = 0;
+	char *p;
+
+	memset(o, 0, sizeof(*o));
+	o->words = malloc(sizeof(*o->words) * VM16_MM_SIZE);
+	if (!o->words) {
+		log_fatal("Out of memory\n");
+	}
+	relocatable = true;
+	free(tags);
+	tags = NULL;
+	parse(in, o->words);
+	o->path = in->name;
+	o->nwords = idx;
+	o->nreloc = nfixups;
+	o->words = realloc(o->words, sizeof(*o->words) * (idx + 1));
+	o->reloc = malloc(sizeof(*o->reloc) * (nfixups + 1));
+	o->sym = malloc(sizeof(*o->sym) * (symtab->used + nfixups + 1));
+	imports = symtab_create(16);
+	if (!o->words || !o->reloc || !o->sym || !imports) {
+		log_fatal("Out of memory\n");
+	}
+	for (i = 0; i < symtab->used; ++i) {
+		s = &symtab->sym[i];
+		add_sym(o, s->name, s->len, s->value - VM16_ADDR_START, OBJ_DEFINED);
+	}
+	/* Labels used but not defined are numbered after the defined ones */
+	for (i = 0; i < nfixups; ++i) {
+		k = &fixups[i].label;
+		o->reloc[i].idx = fixups[i].idx;
+		o->reloc[i].opcode = fixups[i].opcode;
+		o->reloc[i].rd = fixups[i].rd;
+		o->reloc[i].sym = symtab_find(symtab, k);
+		if (o->reloc[i].sym < symtab->used) {
+			continue;
+		}
+		if (!symtab_at(imports, k)) {
+			v = symtab_getv(imports, k);
+			if (!v) {
+				log_fatal("Out of memory\n");
 			}
-			tok = lex(in);
+			*v = o->nsym;
+			add_sym(o, k->bytes, k->len, 0, 0);
 		}
-		txt_reset(in);
+		o->reloc[i].sym = *symtab_at(imports, k);
+	}
+	symtab_destroy(imports);
+	nfixups = 0;
+	/* Relocations name symbols in 16 bits */
+	if (o->nsym > UINT16_MAX) {
+		log_fatal("'%s' uses more than %u labels, too many for an object\n",
+		          in->name, UINT16_MAX);
+	}
+	/* Names move out of the source, which the object outlives */
+	for (i = 0; i < o->nsym; ++i)
+		len += o->sym[i].len;
+	o->names = p = malloc(len + 1);
+	if (!p) {
+		log_fatal("Out of memory\n");
+	}
+	for (i = 0; i < o->nsym; ++i) {
+		memcpy(p, o->sym[i].name, o->sym[i].len);
+		o->sym[i].name = p;
+		p += o->sym[i].len;
 	}
-	return idx;
 }
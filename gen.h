@@ -1,10 +1,49 @@
 #ifndef GEN_H__
 #define GEN_H__
 
+#include "layout.h"
+#include "opt.h"
+#include "prof.h"
+#include "symtab.h"
 #include "txt.h"
 #include "vm16.h"
 
+struct obj;
+
+/* Labels of the program assembled last by the calling thread */
+extern __thread struct symtab *symtab;
+
+/* Run the peephole optimizer over every image assembled, see opt.h */
+extern bool optimize;
+/* What the optimizer removed from the images the calling thread assembled */
+extern __thread struct opt_stats optimized;
+/* Lay out every image assembled by this profile when not NULL, see layout.h */
+extern struct prof const *profile;
+/* What laying out changed in the images the calling thread assembled */
+extern __thread struct layout_stats reordered;
+
+/*
+ * Assemble a source in a single pass into out, returns the number of
+ * words. Words that are not instructions are reported once each and
+ * parsing goes on, other errors exit. Undefined labels are only known
+ * once the whole source is read, so the first one is reported after
+ * everything else, not where it is used in the source.
+ */
 size_t
 assemble(struct txt *in, uint16_t out[VM16_MM_SIZE]);
 
+/*
+ * Assemble a source into a relocatable object, see obj.h. Labels that are
+ * not defined are left for the linker. Exits on errors like assemble.
+ */
+void
+assemble_obj(struct txt *in, struct obj *o);
+
+/*
+ * Write the one or two words of la, load or store (opcode VM16_ADDI,
+ * VM16_LW or VM16_SW) of an address, returns how many.
+ */
+size_t
+expand(uint16_t *out, uint16_t opcode, uint16_t rd, uint16_t addr);
+
 #endif
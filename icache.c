@@ -0,0 +1,355 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "icache.h"
+#include "jit.h"
+#include "vm16.h"
+
+bool
+icache_attach(struct vm16 *v)
+{
+	struct icache *ic;
+	size_t i;
+
+	if (v->ic) {
+		return true;
+	}
+	ic = malloc(sizeof(*ic));
+	if (!ic) {
+		return false;
+	}
+	for (i = 0; i < VM16_MM_SIZE; ++i) {
+		ic->insn[i].op = IC_DECODE;
+		ic->back[i] = 0;
+	}
+	/* Translated code would miss the writes of the interpreters */
+	jit_detach(v);
+	v->ic = ic;
+	return true;
+}
+
+void
+icache_detach(struct vm16 *v)
+{
+	free(v->ic);
+	v->ic = NULL;
+}
+
+void
+icache_decode(struct vm16_insn *in, uint16_t ir)
+{
+	uint16_t op, im7;
+
+	op     = (ir & 0x0007) >> 0;
+	in->rd = (ir & 0x0038) >> 3;
+	in->r1 = (ir & 0x01C0) >> 6;
+	in->r2 = (ir & 0xE000) >> 13;
+	in->ir = ir;
+	/* Sign extend the 7-bit immediate */
+	im7 = (ir & 0xFE00) >> 9;
+	im7 |= im7 & 0x40 ? 0xFF80 : 0x0000;
+
+	switch (op) {
+	case VM16_LUI:
+	case VM16_AUIPC:
+		in->op = op;
+		in->im = ir & 0xFFC0;
+		break;
+	case VM16_MATH:
+		/* Only altcodes 0-7 are defined, the others do nothing */
+		if ((ir & 0x1E00) >> 9 > VM16_LT) {
+			in->op = IC_NOP;
+		} else {
+			in->op = IC_ADD + ((ir & 0x1E00) >> 9);
+		}
+		in->im = 0;
+		break;
+	case VM16_BEQ:
+		/* Comparing a register with itself always branches */
+		in->op = in->rd == in->r1 ? IC_JMP : IC_BEQ;
+		in->im = im7;
+		break;
+	default:
+		in->op = op;
+		in->im = im7;
+		break;
+	}
+	/* Writes to register zero are discarded, loads keep their side effect */
+	if (in->rd == 0 && in->op != IC_JALR && in->op != IC_BEQ
+	&& in->op != IC_JMP && in->op != IC_LW && in->op != IC_SW) {
+		in->op = IC_NOP;
+	}
+}
+
+/* Record that the superinstruction at addr covers n words */
+static void
+cover(struct icache *ic, uint16_t addr, uint16_t n)
+{
+	uint16_t k;
+
+	for (k = 1; k < n; ++k) {
+		if (ic->back[addr + k] < k)
+			ic->back[addr + k] = k;
+	}
+}
+
+void
+icache_fill(struct icache *ic, struct vm16 const *v, uint16_t addr)
+{
+	struct vm16_insn *in, next;
+	uint16_t n;
+
+	in = &ic->insn[addr];
+	icache_decode(in, VM16_PEEK(v, addr));
+	/* Never look past the end of memory, the halt address follows it */
+	if (addr + 1 >= VM16_MM_SIZE) {
+		return;
+	}
+	icache_decode(&next, VM16_PEEK(v, addr + 1));
+	switch (in->op) {
+	case IC_LUI:
+		if (next.rd != in->rd || next.r1 != in->rd) {
+			return;
+		}
+		switch (next.op) {
+		case IC_ADDI:
+			in->op = IC_LI;
+			break;
+		case IC_LW:
+			in->op = IC_LOAD;
+			break;
+		case IC_SW:
+			in->op = IC_STORE;
+			break;
+		default:
+			return;
+		}
+		in->im += next.im;
+		cover(ic, addr, 2);
+		break;
+	case IC_NOP:
+		for (n = 1; next.op == IC_NOP && n < IC_SPAN_MAX; ++n) {
+			if (addr + n + 1 >= VM16_MM_SIZE)
+				break;
+			icache_decode(&next, VM16_PEEK(v, addr + n + 1));
+		}
+		if (n > 1) {
+			in->op = IC_NOPS;
+			in->im = n;
+			cover(ic, addr, n);
+		}
+		break;
+	}
+}
+
+void
+icache_inval(struct icache *ic, uint16_t addr)
+{
+	uint16_t n;
+
+	addr = VM16_ADDR(addr);
+	n = ic->back[addr];
+	ic->back[addr] = 0;
+	for (;;) {
+		ic->insn[VM16_ADDR(addr - n)].op = IC_DECODE;
+		if (n-- == 0)
+			break;
+	}
+}
+
+/* Fetch the pre-decoded record at the program counter */
+static struct vm16_insn const *
+fetch(struct vm16 *v)
+{
+	struct vm16_insn *in;
+
+	in = &v->ic->insn[v->pc];
+	if (in->op == IC_DECODE) {
+		icache_fill(v->ic, v, v->pc);
+	}
+	v->ir = in->ir;
+	v->pc++;
+	return in;
+}
+
+/* Act on the outcome of a device access by the instruction before pc */
+static void
+io(struct vm16 *v, int io)
+{
+	switch (io) {
+	case VM16_IO_HALT:
+		v->pc = VM16_ADDR_HALT;
+		break;
+	case VM16_IO_BLOCK:
+	case VM16_IO_FAULT:
+		v->pc -= 1;
+		v->steps -= 1;
+		v->status = io == VM16_IO_BLOCK ? VM16_BLOCKED : VM16_FAULT;
+		break;
+	}
+}
+
+/* Load a word into register rd, trapping into the device bus */
+static void
+load(struct vm16 *v, uint16_t a, uint8_t rd)
+{
+	if (a >= VM16_IO_SIZE) {
+		v->r[rd] = VM16_PEEK(v, a);
+	} else {
+		io(v, vm16_io_read(v, a, &v->r[rd]));
+	}
+	v->r[0] = 0;
+}
+
+/* Store a word, trapping into the device bus */
+static void
+store(struct vm16 *v, uint16_t a, uint16_t w)
+{
+	if (a >= VM16_IO_SIZE) {
+		if (!vm16_poke(v, a, w)) {
+			io(v, VM16_IO_FAULT);
+			return;
+		}
+		icache_inval(v->ic, a);
+	} else {
+		io(v, vm16_io_write(v, a, w));
+	}
+}
+
+/* Execute a pre-decoded record, the program counter is already advanced */
+static void
+execute(struct vm16 *v, struct vm16_insn const *in)
+{
+	v->steps += 1;
+	switch (in->op) {
+	case IC_LUI:
+		v->r[in->rd] = in->im;
+		break;
+	case IC_AUIPC:
+		v->r[in->rd] = v->pc + in->im;
+		break;
+	case IC_JALR:
+		if (in->rd) {
+			v->r[in->rd] = v->pc + 1;
+		}
+		v->pc = v->r[in->r1] + in->im;
+		break;
+	case IC_BEQ:
+		v->pc += v->r[in->rd] == v->r[in->r1] ? in->im : 0;
+		break;
+	case IC_JMP:
+		v->pc += in->im;
+		break;
+	case IC_LW:
+		load(v, VM16_ADDR(v->r[in->r1] + in->im), in->rd);
+		break;
+	case IC_SW:
+		store(v, VM16_ADDR(v->r[in->r1] + in->im), v->r[in->rd]);
+		break;
+	case IC_ADDI:
+		v->r[in->rd] = v->r[in->r1] + in->im;
+		break;
+	case IC_ADD:
+		v->r[in->rd] = v->r[in->r1] + v->r[in->r2];
+		break;
+	case IC_SUB:
+		v->r[in->rd] = v->r[in->r1] - v->r[in->r2];
+		break;
+	case IC_SLL:
+		v->r[in->rd] = v->r[in->r1] << v->r[in->r2];
+		break;
+	case IC_SRL:
+		v->r[in->rd] = v->r[in->r1] >> v->r[in->r2];
+		break;
+	case IC_NAND:
+		v->r[in->rd] = ~(v->r[in->r1] & v->r[in->r2]);
+		break;
+	case IC_AND:
+		v->r[in->rd] = v->r[in->r1] & v->r[in->r2];
+		break;
+	case IC_OR:
+		v->r[in->rd] = v->r[in->r1] | v->r[in->r2];
+		break;
+	case IC_LT:
+		v->r[in->rd] = v->r[in->r1] < v->r[in->r2];
+		break;
+	case IC_NOP:
+		break;
+	case IC_LI:
+		v->r[in->rd] = in->im;
+		v->pc += 1;
+		v->steps += 1;
+		break;
+	case IC_LOAD:
+		/* A retried load reads the address the LUI left in the register */
+		v->r[in->rd] = in->ir & 0xFFC0;
+		v->pc += 1;
+		v->steps += 1;
+		load(v, VM16_ADDR(in->im), in->rd);
+		break;
+	case IC_STORE:
+		/* The stored value is what the LUI left in the register */
+		v->r[in->rd] = in->ir & 0xFFC0;
+		v->pc += 1;
+		v->steps += 1;
+		store(v, VM16_ADDR(in->im), v->r[in->rd]);
+		break;
+	case IC_NOPS:
+		v->pc += in->im - 1;
+		v->steps += in->im - 1;
+		break;
+	}
+}
+
+void
+vm16_exec_cached(struct vm16 *v)
+{
+	vm16_run_cached(v, UINT64_MAX);
+}
+
+int
+vm16_run_cached(struct vm16 *v, uint64_t max)
+{
+	uint64_t end = vm16_run_begin(v, max);
+
+	/* Without a cache the reference interpreter is the only option */
+	if (!icache_attach(v)) {
+		return vm16_run(v, max);
+	}
+	while (v->pc != VM16_ADDR_HALT && v->status == VM16_RUNNING) {
+		/* Superinstructions may overshoot a budget that is nearly used */
+		if (end - v->steps > IC_SPAN_MAX) {
+			execute(v, fetch(v));
+		} else if (v->steps < end) {
+			vm16_step_cached(v);
+		} else {
+			break;
+		}
+	}
+	return vm16_status(v);
+}
+
+void
+vm16_step_cached(struct vm16 *v)
+{
+	struct vm16_insn const *in;
+	struct vm16_insn one;
+
+	if (v->pc == VM16_ADDR_HALT) {
+		return;
+	}
+	if (!icache_attach(v)) {
+		vm16_step(v);
+		return;
+	}
+	in = fetch(v);
+	/* Superinstructions are split back into their first instruction */
+	if (in->op >= IC_LI && in->op <= IC_NOPS) {
+		icache_decode(&one, in->ir);
+		in = &one;
+	}
+	execute(v, in);
+}
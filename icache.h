@@ -0,0 +1,104 @@
+/* See LICENSE file for copyright and license details */
+#ifndef ICACHE_H__
+#define ICACHE_H__
+
+#include "vm16.h"
+
+/* Dispatch codes of pre-decoded instructions, primary opcodes first */
+enum {
+	IC_LUI,
+	IC_AUIPC,
+	IC_JALR,
+	IC_BEQ,
+	IC_LW,
+	IC_SW,
+	IC_ADDI,
+	/* One code per MATH altcode, in altcode order */
+	IC_ADD,
+	IC_SUB,
+	IC_SLL,
+	IC_SRL,
+	IC_NAND,
+	IC_AND,
+	IC_OR,
+	IC_LT,
+	/* Instructions without any effect on the machine */
+	IC_NOP,
+	/* BEQ comparing a register with itself */
+	IC_JMP,
+	/*
+	 * Superinstructions fusing the words starting at their address: LUI
+	 * followed by an ADDI, LW or SW on the same register as the li, la,
+	 * load and store pseudo-ops expand to, and a run of NOPs.
+	 */
+	IC_LI,
+	IC_LOAD,
+	IC_STORE,
+	IC_NOPS,
+	/*
+	 * The word has not been decoded since it was last written. The record
+	 * of the halt address always keeps this code.
+	 */
+	IC_DECODE,
+	IC_COUNT,
+};
+
+/* A pre-decoded instruction */
+struct vm16_insn {
+	uint8_t op;  /* Dispatch code */
+	uint8_t rd;  /* Destination register */
+	uint8_t r1;  /* First source register */
+	uint8_t r2;  /* Second source register */
+	uint16_t im; /* Shifted im10, sign extended im7 or fused operand */
+	uint16_t ir; /* The (first) instruction word that was decoded */
+};
+
+/* Maximum number of words a superinstruction covers */
+#define IC_SPAN_MAX 255
+
+/* One pre-decoded record for every word of main memory */
+struct icache {
+	struct vm16_insn insn[VM16_MM_SIZE];
+	/* How far back the furthest superinstruction covering a word starts */
+	uint8_t back[VM16_MM_SIZE];
+};
+
+/*
+ * Attach an empty instruction cache to a machine. A machine keeps either
+ * pre-decoded or translated code, so this drops its translation cache.
+ */
+bool
+icache_attach(struct vm16 *v);
+
+/* Release the instruction cache of a machine, if any */
+void
+icache_detach(struct vm16 *v);
+
+/* Decode a single instruction word into a pre-decoded record */
+void
+icache_decode(struct vm16_insn *in, uint16_t ir);
+
+/* Decode the record at addr, fusing it with the words that follow */
+void
+icache_fill(struct icache *ic, struct vm16 const *v, uint16_t addr);
+
+/*
+ * Mark the record of the word at addr stale after it has been written,
+ * along with any superinstruction covering it
+ */
+void
+icache_inval(struct icache *ic, uint16_t addr);
+
+/* Execute from the instruction cache until the program counter equals 0 */
+void
+vm16_exec_cached(struct vm16 *v);
+
+/* Execute at most max instructions from the instruction cache, see vm16_run */
+int
+vm16_run_cached(struct vm16 *v, uint64_t max);
+
+/* Execute a single instruction from the instruction cache, never fused */
+void
+vm16_step_cached(struct vm16 *v);
+
+#endif
@@ -0,0 +1,226 @@
+/* See LICENSE file for copyright and license details */
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "img.h"
+#include "log.h"
+#include "symtab.h"
+#include "vm16.h"
+
+static uint16_t
+get16(unsigned char const *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+get32(unsigned char const *p)
+{
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static void
+put16(unsigned char *p, uint16_t w)
+{
+	p[0] = w & 0xFF;
+	p[1] = w >> 8;
+}
+
+static void
+put32(unsigned char *p, uint32_t w)
+{
+	put16(p, w & 0xFFFF);
+	put16(p + 2, w >> 16);
+}
+
+/* Words can be used in place when the host is little-endian too */
+static bool
+native(void)
+{
+	uint16_t one = 1;
+
+	return *(unsigned char *)&one == 1;
+}
+
+bool
+img_write(FILE *out, uint16_t const *words, size_t nwords,
+          struct symtab const *st)
+{
+	unsigned char hdr[IMG_HDR_SIZE + IMG_SECT_SIZE], b[4];
+	size_t i, nsym = 0, off = sizeof(hdr);
+
+	if (st) {
+		nsym = st->used;
+	}
+	memcpy(hdr, IMG_MAGIC, 4);
+	put16(hdr + 4, IMG_VERSION);
+	put16(hdr + 6, VM16_ADDR_START);
+	put16(hdr + 8, 1);
+	put16(hdr + 10, 0);
+	put32(hdr + 12, nsym);
+	put32(hdr + 16, nsym ? off + 2 * nwords : 0);
+	/* The assembler lays code and data out as a single run of words */
+	put16(hdr + 20, IMG_CODE);
+	put16(hdr + 22, VM16_ADDR_START);
+	put32(hdr + 24, nwords);
+	put32(hdr + 28, off);
+	fwrite(hdr, 1, sizeof(hdr), out);
+	for (i = 0; i < nwords; ++i) {
+		put16(b, words[i]);
+		fwrite(b, 1, 2, out);
+	}
+	for (i = 0; i < nsym; ++i) {
+		put16(b, st->sym[i].value);
+		put16(b + 2, st->sym[i].len);
+		fwrite(b, 1, 4, out);
+		fwrite(st->sym[i].name, 1, st->sym[i].len, out);
+	}
+	return !ferror(out);
+}
+
+/* Check the headers of a mapped image and find its sections */
+static bool
+parse(struct img *im)
+{
+	unsigned char const *p = im->map;
+	size_t i, k, off, end, n = 0;
+	struct img_sect *s;
+
+	if (im->len < IMG_HDR_SIZE || memcmp(p, IMG_MAGIC, 4)) {
+		return false;
+	}
+	if (get16(p + 4) != IMG_VERSION) {
+		log_error("Unsupported image version %u\n", get16(p + 4));
+		return false;
+	}
+	im->entry = get16(p + 6);
+	if (im->entry >= VM16_MM_SIZE) {
+		return false;
+	}
+	im->nsect = get16(p + 8);
+	im->nsym = get32(p + 12);
+	off = get32(p + 16);
+	if (im->nsect > IMG_SECT_MAX ||
+	    im->len < IMG_HDR_SIZE + IMG_SECT_SIZE * im->nsect) {
+		return false;
+	}
+	for (i = 0; i < im->nsect; ++i) {
+		p = im->map + IMG_HDR_SIZE + IMG_SECT_SIZE * i;
+		s = &im->sect[i];
+		s->kind = get16(p);
+		s->addr = get16(p + 2);
+		s->nwords = get32(p + 4);
+		end = get32(p + 8);
+		if (end % 2 || s->addr >= VM16_MM_SIZE ||
+		    s->nwords >= (size_t)(VM16_MM_SIZE - s->addr) ||
+		    end + 2 * s->nwords > im->len) {
+			return false;
+		}
+		s->words = (uint16_t const *)(im->map + end);
+		n += s->nwords;
+	}
+	/* Symbols must lie within the file */
+	im->sym = NULL;
+	if (im->nsym) {
+		for (k = 0, end = off; k < im->nsym; ++k) {
+			if (end + 4 > im->len || end + 4 + get16(im->map + end + 2) > im->len)
+				return false;
+			end += 4 + get16(im->map + end + 2);
+		}
+		im->sym = im->map + off;
+	}
+	if (native()) {
+		return true;
+	}
+	im->copy = malloc(sizeof(*im->copy) * (n ? n : 1));
+	if (!im->copy) {
+		return false;
+	}
+	for (i = 0, n = 0; i < im->nsect; ++i) {
+		s = &im->sect[i];
+		p = (unsigned char const *)s->words;
+		s->words = im->copy + n;
+		for (k = 0; k < s->nwords; ++k)
+			im->copy[n++] = get16(p + 2 * k);
+	}
+	return true;
+}
+
+bool
+img_open(struct img *im, char const *path)
+{
+	struct stat st;
+	int fd;
+
+	memset(im, 0, sizeof(*im));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_error("Unable to open '%s'\n", path);
+		return false;
+	}
+	if (fstat(fd, &st) || st.st_size < IMG_HDR_SIZE) {
+		log_error("'%s' is not an image\n", path);
+		close(fd);
+		return false;
+	}
+	im->len = st.st_size;
+	im->map = mmap(NULL, im->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (im->map == MAP_FAILED) {
+		log_error("Unable to map '%s'\n", path);
+		im->map = NULL;
+		return false;
+	}
+	if (!parse(im)) {
+		log_error("'%s' is not a valid image\n", path);
+		img_close(im);
+		return false;
+	}
+	return true;
+}
+
+bool
+img_load(struct img const *im, struct vm16 *v)
+{
+	size_t i;
+
+	for (i = 0; i < im->nsect; ++i) {
+		if (!vm16_load_at(v, im->sect[i].addr, im->sect[i].words, im->sect[i].nwords))
+			return false;
+	}
+	v->pc = im->entry;
+	return true;
+}
+
+bool
+img_sym(struct img const *im, char const *name, uint16_t *value)
+{
+	unsigned char const *p = im->sym;
+	size_t i, len = strlen(name);
+
+	for (i = 0; i < im->nsym; ++i) {
+		if (get16(p + 2) == len && !memcmp(p + 4, name, len)) {
+			*value = get16(p);
+			return true;
+		}
+		p += 4 + get16(p + 2);
+	}
+	return false;
+}
+
+void
+img_close(struct img *im)
+{
+	if (im->map) {
+		munmap(im->map, im->len);
+	}
+	free(im->copy);
+	memset(im, 0, sizeof(*im));
+}
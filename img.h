@@ -0,0 +1,87 @@
+/* See LICENSE file for copyright and license details */
+#ifndef IMG_H__
+#define IMG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "symtab.h"
+#include "vm16.h"
+
+/*
+ * Binary images hold assembled programs ready to be loaded. All fields
+ * are little-endian. An image starts with a header:
+ *
+ *   0   4  magic, "VM16"
+ *   4   2  version, IMG_VERSION
+ *   6   2  entry address
+ *   8   2  number of sections
+ *   10  2  reserved, 0
+ *   12  4  number of symbols
+ *   16  4  file offset of the symbol table, 0 without symbols
+ *
+ * followed by the table of sections, 12 bytes each:
+ *
+ *   0   2  kind, IMG_CODE or IMG_DATA
+ *   2   2  load address
+ *   4   4  number of words
+ *   8   4  file offset of the words, a multiple of 2
+ *
+ * Symbols are a 2 byte value and a 2 byte name length, then the name.
+ */
+#define IMG_MAGIC    "VM16"
+#define IMG_VERSION  2
+#define IMG_HDR_SIZE 20
+#define IMG_SECT_SIZE 12
+#define IMG_SECT_MAX 16
+
+/* Kinds of sections */
+#define IMG_CODE 0x1
+#define IMG_DATA 0x2
+
+struct img_sect {
+	uint16_t kind;
+	uint16_t addr;
+	size_t nwords;
+	uint16_t const *words; /* Into the mapped file where byte order allows */
+};
+
+/* An image mapped from a file */
+struct img {
+	unsigned char *map;
+	size_t len;
+	uint16_t entry;
+	size_t nsect;
+	struct img_sect sect[IMG_SECT_MAX];
+	size_t nsym;
+	unsigned char const *sym;  /* Symbol table in the mapped file */
+	uint16_t *copy;            /* Words swapped on big-endian hosts */
+};
+
+/*
+ * Write words assembled for VM16_ADDR_START as an image, with the labels
+ * of st unless it is NULL. Returns false on write errors.
+ */
+bool
+img_write(FILE *out, uint16_t const *words, size_t nwords,
+          struct symtab const *st);
+
+/* Map and check an image, returns false when it cannot be used */
+bool
+img_open(struct img *im, char const *path);
+
+/* Load every section into a machine and jump to the entry address */
+bool
+img_load(struct img const *im, struct vm16 *v);
+
+/* Look up the value of a symbol, returns false when there is none */
+bool
+img_sym(struct img const *im, char const *name, uint16_t *value);
+
+/* Unmap an image */
+void
+img_close(struct img *im);
+
+#endif
@@ -0,0 +1,828 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icache.h"
+#include "jit.h"
+#include "threaded.h"
+#include "vm16.h"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+/* Size of the executable code buffer */
+#define CODE_SIZE (4 << 20)
+/* Maximum number of guest instructions in a block */
+#define BLOCK_MAX 64
+/* Upper bound on the native bytes emitted for one guest instruction */
+#define INSN_MAX 128
+
+/* Reasons a store must leave the inline path */
+#define TRAP_DEV  0x1 /* The word is memory-mapped I/O */
+#define TRAP_CODE 0x2 /* The word has been translated */
+
+/* Host registers */
+enum {RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15};
+
+/*
+ * Host registers holding guest registers 1-7, zero extended to 32 bits.
+ * Register zero has no host register. Everything but r10 is callee-saved,
+ * rdi holds the machine, r9 its page table and rax, rcx, rdx and r11 are
+ * scratch.
+ */
+static int const hreg[8] = {-1, RBX, RBP, R12, R13, R14, R15, R10};
+
+/* Returned in rax:rdx by translated code */
+struct jret {
+	uint64_t pc;   /* Guest address to continue at */
+	uint64_t site; /* End of the exit site taken, or 0 when not linkable */
+};
+
+typedef struct jret (*entry_fn)(struct vm16 *v, uint8_t const *code);
+
+struct jit {
+	uint8_t *buf;                  /* Executable code buffer */
+	uint8_t *end;                  /* First free byte of the code buffer */
+	uint8_t *start;                /* First byte after the shared stubs */
+	uint8_t *exit;                 /* Common exit of every block */
+	entry_fn enter;                /* Enter translated code from C */
+	bool stale;                    /* Translated code has been written to */
+	bool writable;                 /* Code buffer is writable, not executable */
+	unsigned gen;                  /* Incremented on every flush */
+	size_t nblk;                   /* Number of translated blocks */
+	unsigned n;                    /* Instructions of the block translated */
+	uint64_t limit;                /* Step count blocks must not pass */
+	uint16_t bstart[VM16_MM_SIZE]; /* First guest word of each block */
+	uint16_t blen[VM16_MM_SIZE];   /* Number of guest words in each block */
+	uint8_t *code[VM16_MM_SIZE];   /* Block translated at a guest address */
+	uint8_t trap[VM16_MM_SIZE];    /* TRAP_ flags of each guest word */
+};
+
+static void
+emit1(struct jit *j, uint8_t b)
+{
+	*j->end++ = b;
+}
+
+static void
+emit4(struct jit *j, uint32_t w)
+{
+	memcpy(j->end, &w, sizeof(w));
+	j->end += sizeof(w);
+}
+
+static void
+emit8(struct jit *j, uint64_t w)
+{
+	memcpy(j->end, &w, sizeof(w));
+	j->end += sizeof(w);
+}
+
+/* Emit a REX prefix when one is needed to reach the registers */
+static void
+rex(struct jit *j, int w, int reg, int rm)
+{
+	uint8_t b = 0x40 | w << 3 | (reg >> 3) << 2 | (rm >> 3);
+
+	if (b != 0x40) {
+		emit1(j, b);
+	}
+}
+
+static void
+modrm(struct jit *j, int mod, int reg, int rm)
+{
+	emit1(j, mod << 6 | (reg & 7) << 3 | (rm & 7));
+}
+
+/* op dst, src on 32-bit registers, op is the opcode of the r/m, reg form */
+static void
+alu_rr(struct jit *j, uint8_t op, int dst, int src)
+{
+	rex(j, 0, src, dst);
+	emit1(j, op);
+	modrm(j, 3, src, dst);
+}
+
+/* op dst, imm32, ext is the opcode extension of the 0x81 group */
+static void
+alu_ri(struct jit *j, int ext, int dst, uint32_t imm)
+{
+	rex(j, 0, 0, dst);
+	emit1(j, 0x81);
+	modrm(j, 3, ext, dst);
+	emit4(j, imm);
+}
+
+static void
+mov_ri(struct jit *j, int dst, uint32_t imm)
+{
+	rex(j, 0, 0, dst);
+	emit1(j, 0xB8 + (dst & 7));
+	emit4(j, imm);
+}
+
+/* Truncate a 32-bit register to its low 16 bits */
+static void
+zext16(struct jit *j, int r)
+{
+	rex(j, 0, r, r);
+	emit1(j, 0x0F);
+	emit1(j, 0xB7);
+	modrm(j, 3, r, r);
+}
+
+/* op r, with ext selecting from the 0xD3 (shift by cl) or 0xF7 group */
+static void
+unary(struct jit *j, uint8_t op, int ext, int r)
+{
+	rex(j, 0, 0, r);
+	emit1(j, op);
+	modrm(j, 3, ext, r);
+}
+
+/* Load guest register g into host register r */
+static void
+get(struct jit *j, int r, int g)
+{
+	if (g == 0) {
+		alu_rr(j, 0x31, r, r);
+	} else {
+		alu_rr(j, 0x89, r, hreg[g]);
+	}
+}
+
+/* Write host register r, truncated to 16 bits, to guest register g */
+static void
+put(struct jit *j, int g, int r)
+{
+	zext16(j, r);
+	alu_rr(j, 0x89, hreg[g], r);
+}
+
+/* eax = (guest register g + im) wrapped into main memory */
+static void
+addr(struct jit *j, int g, uint16_t im)
+{
+	get(j, RAX, g);
+	alu_ri(j, 0, RAX, im);
+	alu_ri(j, 4, RAX, VM16_MM_SIZE - 1);
+}
+
+/* Emit a jump or conditional jump and return the rel32 to patch */
+static uint8_t *
+jump(struct jit *j, int cc)
+{
+	uint8_t *rel;
+
+	if (cc < 0) {
+		emit1(j, 0xE9);
+	} else {
+		emit1(j, 0x0F);
+		emit1(j, 0x80 | cc);
+	}
+	rel = j->end;
+	emit4(j, 0);
+	return rel;
+}
+
+/* Point a rel32 emitted by jump() at target */
+static void
+patch(uint8_t *rel, uint8_t const *target)
+{
+	int32_t d = target - (rel + 4);
+
+	memcpy(rel, &d, sizeof(d));
+}
+
+/* Account for the instructions of the block executed before an exit */
+static void
+count(struct jit *j)
+{
+	/* add qword [rdi + steps], n */
+	emit1(j, 0x48);
+	emit1(j, 0x83);
+	modrm(j, 2, 0, RDI);
+	emit4(j, offsetof(struct vm16, steps));
+	emit1(j, j->n);
+}
+
+/* Leave translated code for a computed guest address already in eax */
+static void
+exit_computed(struct jit *j)
+{
+	count(j);
+	alu_rr(j, 0x31, RDX, RDX);
+	patch(jump(j, -1), j->exit);
+}
+
+/*
+ * Leave translated code for a known guest address. The site starts, after
+ * the step count, with 5 bytes that can later be replaced by a direct jump
+ * to the target block.
+ */
+static void
+exit_linkable(struct jit *j, uint16_t pc)
+{
+	count(j);
+	/* lea rdx, [rip] */
+	emit1(j, 0x48);
+	emit1(j, 0x8D);
+	emit1(j, 0x15);
+	emit4(j, 0);
+	mov_ri(j, RAX, pc);
+	patch(jump(j, -1), j->exit);
+}
+
+/* Size of the lea at the start of a linkable exit site */
+#define SITE_LEA 7
+
+/* Returned by helpers to leave translated code and continue at pc */
+#define LEAVE(pc) (0x10000u | (pc))
+
+/*
+ * Act on the outcome of a device access by the instruction before next.
+ * Returns 0 to carry on with the block.
+ */
+static unsigned
+io(struct vm16 *v, int io, unsigned next)
+{
+	switch (io) {
+	case VM16_IO_HALT:
+		return LEAVE(VM16_ADDR_HALT);
+	case VM16_IO_BLOCK:
+	case VM16_IO_FAULT:
+		/* Leave in front of the access, which then does not count */
+		v->steps -= 1;
+		v->status = io == VM16_IO_BLOCK ? VM16_BLOCKED : VM16_FAULT;
+		return LEAVE(VM16_ADDR(next - 1));
+	}
+	return 0;
+}
+
+/* Load a word from the device window for translated code */
+static unsigned
+load(struct vm16 *v, unsigned a, unsigned next)
+{
+	uint16_t w = 0;
+	unsigned rv;
+
+	rv = io(v, vm16_io_read(v, a, &w), next);
+	return rv ? rv : w;
+}
+
+/*
+ * Store a word for translated code that hit a trapped address, next is the
+ * address of the following word. Returns 0 to carry on with the block.
+ */
+static unsigned
+store(struct vm16 *v, unsigned a, unsigned w, unsigned next)
+{
+	struct jit *j = v->jit;
+	unsigned rv;
+
+	if (a >= VM16_IO_SIZE) {
+		if (!vm16_poke(v, a, w)) {
+			return io(v, VM16_IO_FAULT, next);
+		}
+	} else if ((rv = io(v, vm16_io_write(v, a, w), next))) {
+		return rv;
+	}
+	/* Leave the block at once when it may have rewritten itself */
+	if (j->trap[a] & TRAP_CODE) {
+		j->stale = true;
+		return LEAVE(next);
+	}
+	return 0;
+}
+
+/* r9 = the page table of the machine, which helpers may replace */
+static void
+table(struct jit *j)
+{
+	/* mov r9, [rdi + mm] */
+	emit1(j, 0x4C);
+	emit1(j, 0x8B);
+	modrm(j, 2, R9, RDI);
+	emit4(j, offsetof(struct vm16, mm));
+}
+
+/* Call a helper with the machine in rdi and eax in esi, keeping rdi and r10 */
+static void
+call(struct jit *j, void const *fn)
+{
+	emit1(j, 0x57);
+	emit1(j, 0x41);
+	emit1(j, 0x52);
+	alu_rr(j, 0x89, RSI, RAX);
+	emit1(j, 0x48);
+	emit1(j, 0xB8);
+	emit8(j, (uintptr_t)fn);
+	emit1(j, 0xFF);
+	emit1(j, 0xD0);
+	emit1(j, 0x41);
+	emit1(j, 0x5A);
+	emit1(j, 0x5F);
+	table(j);
+}
+
+/* Emit the entry trampoline and the common exit */
+static void
+stubs(struct jit *j)
+{
+	static int const saved[] = {RBX, RBP, R12, R13, R14, R15};
+	size_t off = offsetof(struct vm16, r);
+	int g, i;
+
+	/* Entry: save callee-saved registers and load the guest registers */
+	j->enter = (entry_fn)(uintptr_t)j->end;
+	for (i = 0; i < 6; ++i) {
+		rex(j, 0, 0, saved[i]);
+		emit1(j, 0x50 + (saved[i] & 7));
+	}
+	/* sub rsp, 8 keeps the stack aligned for helper calls */
+	emit1(j, 0x48);
+	emit1(j, 0x83);
+	emit1(j, 0xEC);
+	emit1(j, 0x08);
+	for (g = 1; g < 8; ++g) {
+		rex(j, 0, hreg[g], RDI);
+		emit1(j, 0x0F);
+		emit1(j, 0xB7);
+		modrm(j, 2, hreg[g], RDI);
+		emit4(j, off + 2 * g);
+	}
+	table(j);
+	/* jmp rsi */
+	emit1(j, 0xFF);
+	emit1(j, 0xE6);
+
+	/* Exit: write back the guest registers, rax and rdx are the result */
+	j->exit = j->end;
+	for (g = 1; g < 8; ++g) {
+		emit1(j, 0x66);
+		rex(j, 0, hreg[g], RDI);
+		emit1(j, 0x89);
+		modrm(j, 2, hreg[g], RDI);
+		emit4(j, off + 2 * g);
+	}
+	emit1(j, 0x48);
+	emit1(j, 0x83);
+	emit1(j, 0xC4);
+	emit1(j, 0x08);
+	for (i = 5; i >= 0; --i) {
+		rex(j, 0, 0, saved[i]);
+		emit1(j, 0x58 + (saved[i] & 7));
+	}
+	emit1(j, 0xC3);
+	j->start = j->end;
+}
+
+/* Make the code buffer writable or executable, never both at once */
+static bool
+protect(struct jit *j, bool writable)
+{
+	if (j->writable == writable) {
+		return true;
+	}
+	if (mprotect(j->buf, CODE_SIZE,
+	             PROT_READ | (writable ? PROT_WRITE : PROT_EXEC))) {
+		return false;
+	}
+	j->writable = writable;
+	return true;
+}
+
+/* Drop every translated block */
+static void
+flush(struct jit *j)
+{
+	size_t i;
+	uint16_t k;
+
+	for (i = 0; i < j->nblk; ++i) {
+		j->code[j->bstart[i]] = NULL;
+		for (k = 0; k < j->blen[i]; ++k)
+			j->trap[j->bstart[i] + k] &= ~TRAP_CODE;
+	}
+	j->nblk = 0;
+	j->end = j->start;
+	j->stale = false;
+	j->gen += 1;
+}
+
+/* ecx = the page of the address in eax */
+static void
+pageno(struct jit *j)
+{
+	/* mov ecx, eax; shr ecx, VM16_PAGE_BITS */
+	alu_rr(j, 0x89, RCX, RAX);
+	emit1(j, 0xC1);
+	modrm(j, 3, 5, RCX);
+	emit1(j, VM16_PAGE_BITS);
+}
+
+/* rcx = the page in ecx, r11 = the offset of the address in eax in it */
+static void
+page(struct jit *j)
+{
+	/* mov rcx, [r9 + rcx*8 + pg] */
+	emit1(j, 0x49);
+	emit1(j, 0x8B);
+	modrm(j, 2, RCX, 4);
+	emit1(j, 0xC9);
+	emit4(j, offsetof(struct vm16_mem, pg));
+	/* movzx r11d, al */
+	emit1(j, 0x44);
+	emit1(j, 0x0F);
+	emit1(j, 0xB6);
+	modrm(j, 3, R11, RAX);
+}
+
+/* Translate a guest load, next is the address of the following word */
+static void
+emit_lw(struct jit *j, struct vm16_insn const *in, uint16_t next)
+{
+	uint8_t *slow, *done, *cont;
+
+	addr(j, in->r1, in->im);
+	/* cmp eax, VM16_IO_SIZE; jb slow */
+	alu_ri(j, 7, RAX, VM16_IO_SIZE);
+	slow = jump(j, 0x2);
+	if (in->rd) {
+		pageno(j);
+		page(j);
+		/* movzx eax, word [rcx + r11*2 + w] */
+		emit1(j, 0x42);
+		emit1(j, 0x0F);
+		emit1(j, 0xB7);
+		modrm(j, 2, RAX, 4);
+		emit1(j, 0x59);
+		emit4(j, offsetof(struct vm16_page, w));
+		put(j, in->rd, RAX);
+	}
+	done = jump(j, -1);
+
+	/* Slow path: call load(v, eax, next), reads may have side effects */
+	patch(slow, j->end);
+	mov_ri(j, RDX, next);
+	call(j, (void const *)(uintptr_t)load);
+	/* test eax, LEAVE(0); jz cont */
+	emit1(j, 0xA9);
+	emit4(j, LEAVE(0));
+	cont = jump(j, 0x4);
+	zext16(j, RAX);
+	exit_computed(j);
+	patch(cont, j->end);
+	if (in->rd) {
+		put(j, in->rd, RAX);
+	}
+	patch(done, j->end);
+}
+
+/* Translate a guest store, next is the address of the following word */
+static void
+emit_sw(struct jit *j, struct vm16_insn const *in, uint16_t next)
+{
+	uint8_t *slow, *done, *cont, *shared;
+
+	get(j, RDX, in->rd);
+	addr(j, in->r1, in->im);
+	/* mov rcx, trap; cmp byte [rcx + rax], 0; jne slow */
+	emit1(j, 0x48);
+	emit1(j, 0xB9);
+	emit8(j, (uintptr_t)j->trap);
+	emit1(j, 0x80);
+	emit1(j, 0x3C);
+	emit1(j, 0x01);
+	emit1(j, 0x00);
+	slow = jump(j, 0x5);
+	/* Shared pages are copied before they are written */
+	pageno(j);
+	/* cmp byte [rdi + rcx + own], 0; je slow */
+	emit1(j, 0x80);
+	modrm(j, 2, 7, 4);
+	emit1(j, 0x0F);
+	emit4(j, offsetof(struct vm16, own));
+	emit1(j, 0x00);
+	shared = jump(j, 0x4);
+	page(j);
+	/* mov word [rcx + r11*2 + w], dx */
+	emit1(j, 0x66);
+	emit1(j, 0x42);
+	emit1(j, 0x89);
+	modrm(j, 2, RDX, 4);
+	emit1(j, 0x59);
+	emit4(j, offsetof(struct vm16_page, w));
+	done = jump(j, -1);
+
+	/* Slow path: call store(v, eax, edx, next) */
+	patch(slow, j->end);
+	patch(shared, j->end);
+	mov_ri(j, RCX, next);
+	call(j, (void const *)(uintptr_t)store);
+	alu_rr(j, 0x85, RAX, RAX);
+	cont = jump(j, 0x4);
+	zext16(j, RAX);
+	exit_computed(j);
+	patch(cont, j->end);
+	patch(done, j->end);
+}
+
+/* Translate one MATH instruction */
+static void
+emit_math(struct jit *j, struct vm16_insn const *in)
+{
+	get(j, RAX, in->r1);
+	get(j, RCX, in->r2);
+	switch (in->op) {
+	case IC_ADD:
+		alu_rr(j, 0x01, RAX, RCX);
+		break;
+	case IC_SUB:
+		alu_rr(j, 0x29, RAX, RCX);
+		break;
+	case IC_SLL:
+		unary(j, 0xD3, 4, RAX);
+		break;
+	case IC_SRL:
+		unary(j, 0xD3, 5, RAX);
+		break;
+	case IC_NAND:
+		alu_rr(j, 0x21, RAX, RCX);
+		unary(j, 0xF7, 2, RAX);
+		break;
+	case IC_AND:
+		alu_rr(j, 0x21, RAX, RCX);
+		break;
+	case IC_OR:
+		alu_rr(j, 0x09, RAX, RCX);
+		break;
+	case IC_LT:
+		/* cmp eax, ecx; setb al; movzx eax, al */
+		alu_rr(j, 0x39, RAX, RCX);
+		emit1(j, 0x0F);
+		emit1(j, 0x92);
+		emit1(j, 0xC0);
+		emit1(j, 0x0F);
+		emit1(j, 0xB6);
+		emit1(j, 0xC0);
+		break;
+	}
+	put(j, in->rd, RAX);
+}
+
+/* Translate the basic block starting at pc, or return NULL */
+static uint8_t *
+translate(struct jit *j, struct vm16 const *v, uint16_t pc)
+{
+	struct vm16_insn in;
+	uint8_t *code, *fall, *bail;
+	uint16_t a, next, n;
+	bool end = false;
+
+	if (j->end + BLOCK_MAX * INSN_MAX > j->buf + CODE_SIZE) {
+		flush(j);
+	}
+	code = j->end;
+	/*
+	 * Leave before running a block that could pass the step limit:
+	 * mov rax, [rdi + steps]; add rax, BLOCK_MAX; mov rcx, &limit;
+	 * cmp rax, [rcx]; ja bail
+	 */
+	emit1(j, 0x48);
+	emit1(j, 0x8B);
+	modrm(j, 2, RAX, RDI);
+	emit4(j, offsetof(struct vm16, steps));
+	emit1(j, 0x48);
+	emit1(j, 0x83);
+	emit1(j, 0xC0);
+	emit1(j, BLOCK_MAX);
+	emit1(j, 0x48);
+	emit1(j, 0xB9);
+	emit8(j, (uintptr_t)&j->limit);
+	emit1(j, 0x48);
+	emit1(j, 0x3B);
+	emit1(j, 0x01);
+	bail = jump(j, 0x7);
+	for (a = pc, n = 1; !end; a = next, ++n) {
+		j->n = n;
+		icache_decode(&in, VM16_PEEK(v, a));
+		next = VM16_ADDR(a + 1);
+		switch (in.op) {
+		case IC_LUI:
+			mov_ri(j, hreg[in.rd], in.im);
+			break;
+		case IC_AUIPC:
+			mov_ri(j, hreg[in.rd], (uint16_t)(next + in.im));
+			break;
+		case IC_JALR:
+			if (in.rd) {
+				mov_ri(j, hreg[in.rd], (uint16_t)(next + 1));
+			}
+			addr(j, in.r1, in.im);
+			exit_computed(j);
+			end = true;
+			break;
+		case IC_BEQ:
+			get(j, RAX, in.rd);
+			get(j, RCX, in.r1);
+			alu_rr(j, 0x39, RAX, RCX);
+			fall = jump(j, 0x5);
+			exit_linkable(j, VM16_ADDR(next + in.im));
+			patch(fall, j->end);
+			exit_linkable(j, next);
+			end = true;
+			break;
+		case IC_JMP:
+			exit_linkable(j, VM16_ADDR(next + in.im));
+			end = true;
+			break;
+		case IC_LW:
+			emit_lw(j, &in, next);
+			break;
+		case IC_SW:
+			emit_sw(j, &in, next);
+			break;
+		case IC_ADDI:
+			get(j, RAX, in.r1);
+			alu_ri(j, 0, RAX, in.im);
+			put(j, in.rd, RAX);
+			break;
+		case IC_NOP:
+			break;
+		default:
+			emit_math(j, &in);
+			break;
+		}
+		/* Blocks never run into the halt address or grow without bound */
+		if (!end && (next == VM16_ADDR_HALT || n == BLOCK_MAX)) {
+			exit_linkable(j, next);
+			end = true;
+		}
+	}
+	patch(bail, j->end);
+	mov_ri(j, RAX, pc);
+	alu_rr(j, 0x31, RDX, RDX);
+	patch(jump(j, -1), j->exit);
+	j->bstart[j->nblk] = pc;
+	j->blen[j->nblk] = n - 1;
+	j->nblk += 1;
+	for (a = 0; a < n - 1; ++a)
+		j->trap[pc + a] |= TRAP_CODE;
+	j->code[pc] = code;
+	return code;
+}
+
+bool
+jit_attach(struct vm16 *v)
+{
+	struct jit *j;
+
+	if (v->jit) {
+		return true;
+	}
+	j = calloc(1, sizeof(*j));
+	if (!j) {
+		return false;
+	}
+	j->buf = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE,
+	              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (j->buf == MAP_FAILED) {
+		free(j);
+		return false;
+	}
+	j->writable = true;
+	j->end = j->buf;
+	stubs(j);
+	if (!protect(j, false)) {
+		munmap(j->buf, CODE_SIZE);
+		free(j);
+		return false;
+	}
+	memset(j->trap, TRAP_DEV, VM16_IO_SIZE);
+	icache_detach(v);
+	v->jit = j;
+	return true;
+}
+
+void
+jit_detach(struct vm16 *v)
+{
+	if (!v->jit) {
+		return;
+	}
+	munmap(v->jit->buf, CODE_SIZE);
+	free(v->jit);
+	v->jit = NULL;
+}
+
+void
+jit_inval(struct jit *j, uint16_t addr)
+{
+	if (j->trap[VM16_ADDR(addr)] & TRAP_CODE) {
+		j->stale = true;
+	}
+}
+
+void
+vm16_exec_jit(struct vm16 *v)
+{
+	vm16_run_jit(v, UINT64_MAX);
+}
+
+int
+vm16_run_jit(struct vm16 *v, uint64_t max)
+{
+	struct jit *j;
+	struct jret ret = {0, 0};
+	uint8_t *code, *site;
+	uint64_t end = vm16_run_begin(v, max);
+	unsigned gen;
+
+	if (v->pc == VM16_ADDR_HALT) {
+		return VM16_HALTED;
+	}
+	if (!jit_attach(v)) {
+		return vm16_run_threaded(v, max);
+	}
+	j = v->jit;
+	j->limit = end;
+	while (v->pc != VM16_ADDR_HALT && v->status == VM16_RUNNING && v->steps < end) {
+		/* Blocks refuse to start this close to the limit */
+		if (end - v->steps < BLOCK_MAX) {
+			vm16_step(v);
+			ret.site = 0;
+			continue;
+		}
+		if (j->stale) {
+			flush(j);
+			ret.site = 0;
+		}
+		gen = j->gen;
+		code = j->code[v->pc];
+		/* Code is only written while the buffer cannot run */
+		if ((!code || ret.site) && !protect(j, true)) {
+			vm16_step(v);
+			ret.site = 0;
+			continue;
+		}
+		if (!code) {
+			code = translate(j, v, v->pc);
+		}
+		/* Chain the exit just taken straight to the block it led to */
+		if (ret.site && gen == j->gen) {
+			site = (uint8_t *)(uintptr_t)ret.site - SITE_LEA;
+			site[0] = 0xE9;
+			patch(site + 1, code);
+		}
+		if (!protect(j, false)) {
+			vm16_step(v);
+			ret.site = 0;
+			continue;
+		}
+		ret = j->enter(v, code);
+		v->pc = ret.pc;
+	}
+	return vm16_status(v);
+}
+
+#else
+
+bool
+jit_attach(struct vm16 *v)
+{
+	(void)v;
+	return false;
+}
+
+void
+jit_detach(struct vm16 *v)
+{
+	(void)v;
+}
+
+void
+jit_inval(struct jit *j, uint16_t addr)
+{
+	(void)j;
+	(void)addr;
+}
+
+void
+vm16_exec_jit(struct vm16 *v)
+{
+	vm16_exec_threaded(v);
+}
+
+int
+vm16_run_jit(struct vm16 *v, uint64_t max)
+{
+	return vm16_run_threaded(v, max);
+}
+
+#endif
@@ -0,0 +1,34 @@
+/* See LICENSE file for copyright and license details */
+#ifndef JIT_H__
+#define JIT_H__
+
+#include "vm16.h"
+
+/*
+ * Attach an empty translation cache to a machine. A machine keeps either
+ * translated or pre-decoded code, so this drops its instruction cache.
+ * Fails where native code cannot be generated.
+ */
+bool
+jit_attach(struct vm16 *v);
+
+/* Release the translation cache of a machine, if any */
+void
+jit_detach(struct vm16 *v);
+
+/* Note that the word at addr was written outside of translated code */
+void
+jit_inval(struct jit *j, uint16_t addr);
+
+/*
+ * Execute until the program counter equals 0, translating basic blocks to
+ * native x86-64 code. Falls back to the threaded engine elsewhere.
+ */
+void
+vm16_exec_jit(struct vm16 *v);
+
+/* Execute at most max instructions with translated code, see vm16_run */
+int
+vm16_run_jit(struct vm16 *v, uint64_t max);
+
+#endif
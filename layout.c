@@ -0,0 +1,632 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+#include "log.h"
+#include "opt.h"
+#include "symtab.h"
+#include "vm16.h"
+
+#define OP(w)   ((w) & 0x7)
+#define RD(w)   ((w) >> 3 & 0x7)
+#define R1(w)   ((w) >> 6 & 0x7)
+#define R2(w)   ((w) >> 13 & 0x7)
+#define IM10(w) ((w) >> 6)
+
+#define NONE SIZE_MAX
+#define ALL  0xFE  /* Every register but zero */
+
+/* Straight-line code, control only enters at the start */
+struct block {
+	size_t start, end;   /* Words */
+	uint8_t use;         /* Registers read before they are written */
+	uint8_t def;         /* Registers written */
+	uint8_t live;        /* Registers read before written from the start */
+	size_t succ[2];      /* Blocks control goes to next, NONE for none */
+	bool any;            /* Control may go anywhere */
+};
+
+/* Blocks that fall through to each other, ending in a jump or halt */
+struct chain {
+	size_t start, end;   /* Words */
+	size_t jump;         /* First word of the jump it ends in, or end */
+	size_t target;       /* Word the jump goes to, NONE if unknown */
+	uint16_t reg;        /* Register la loads for the jump, 0 for BEQ */
+	uint64_t taken;      /* Executions of the jump */
+	uint64_t heat;       /* Most executions of one of its words */
+	size_t next, prev;   /* Chains merged after and before it */
+	bool shrink;         /* The la and jalr of the jump become one BEQ */
+};
+
+/* A chain and what it is sorted by */
+struct rank {
+	uint64_t key;
+	size_t chain;
+};
+
+/* Everything laying out one program takes */
+struct lay {
+	uint16_t const *words;
+	uint8_t const *tags;
+	size_t n;
+	uint64_t const *count;
+	uint8_t *lead;       /* Control may reach the word other than in order */
+	uint8_t *frozen;     /* The word may be read or patched as data */
+	uint8_t *keep;       /* The word stays */
+	size_t *bno;         /* Block of each word, one past the last at n */
+	size_t *cno;         /* Chain of each word */
+	size_t *map;         /* New index of each word */
+	size_t *order;       /* Chains as placed */
+	struct block *blk;
+	struct chain *ch;
+	struct rank *rank;
+	size_t nb, nc;
+	bool tail;           /* The last chain runs off the end of the program */
+};
+
+static int
+im7(uint16_t w)
+{
+	int im = w >> 9;
+
+	return im & 0x40 ? im - 0x80 : im;
+}
+
+static bool
+fits(long d)
+{
+	return d >= -64 && d <= 63;
+}
+
+/* Decode the address of the la, load or store at word i, returns its length */
+static size_t
+addr_of(uint16_t const *words, size_t i, uint16_t *a)
+{
+	if (OP(words[i]) == VM16_LUI) {
+		*a = IM10(words[i]) << 6 | (words[i + 1] >> 9 & 0x3F);
+		return 2;
+	}
+	*a = words[i] >> 9 & 0x7F;
+	return 1;
+}
+
+/* Return the length of the la at word i if a jalr to its address follows */
+static size_t
+jump_at(struct lay const *l, size_t i, long *target)
+{
+	uint16_t a, w;
+	size_t len;
+
+	if (l->tags[i] != OPT_ADDR) {
+		return 0;
+	}
+	len = addr_of(l->words, i, &a);
+	if (i + len >= l->n || OP(l->words[i + len - 1]) != VM16_ADDI) {
+		return 0;
+	}
+	w = l->words[i + len];
+	if (l->tags[i + len] != OPT_CODE || OP(w) != VM16_JALR ||
+	    R1(w) != RD(l->words[i]) || im7(w)) {
+		return 0;
+	}
+	*target = (long)a - VM16_ADDR_START;
+	return len;
+}
+
+/* Find the la of the jalr at word i, returns NONE without one */
+static size_t
+jump_from(struct lay const *l, size_t i, long *target)
+{
+	size_t len;
+
+	for (len = 1; len <= 2 && len <= i; ++len) {
+		if (jump_at(l, i - len, target) == len) {
+			return i - len;
+		}
+	}
+	return NONE;
+}
+
+/* Add the registers an instruction reads before writing to a block */
+static void
+regs(struct block *b, uint16_t w)
+{
+	uint8_t use = 0, def = 1 << RD(w);
+
+	switch (OP(w)) {
+	case VM16_LUI:
+	case VM16_AUIPC:
+		break;
+	case VM16_BEQ:
+	case VM16_SW:
+		use = 1 << RD(w) | 1 << R1(w);
+		def = 0;
+		break;
+	case VM16_MATH:
+		use = 1 << R1(w) | 1 << R2(w);
+		break;
+	default:
+		use = 1 << R1(w);
+		break;
+	}
+	b->use |= use & ~b->def & ALL;
+	b->def |= def & ALL;
+}
+
+static void
+lead_at(struct lay *l, long p)
+{
+	if (p >= 0 && (size_t)p <= l->n) {
+		l->lead[p] = 1;
+	}
+}
+
+/* Mark block starts, and the words around addresses taken as data */
+static void
+leaders(struct lay *l, struct symtab const *st)
+{
+	size_t i, k, len;
+	long t, p;
+	uint16_t a;
+
+	l->lead[0] = 1;
+	for (i = 0; i < st->used; ++i)
+		lead_at(l, (long)st->sym[i].value - VM16_ADDR_START);
+	for (i = 0; i < l->n; ++i) {
+		switch (l->tags[i]) {
+		case OPT_DATA:
+			l->lead[i] = l->lead[i + 1] = 1;
+			break;
+		case OPT_ADDR:
+			len = addr_of(l->words, i, &a);
+			p = (long)a - VM16_ADDR_START;
+			lead_at(l, p);
+			/* Loads and stores reach 64 words either way of the address */
+			if (p >= 0 && !jump_at(l, i, &t)) {
+				for (k = p > 64 ? p - 64 : 0; (long)k < p + 64 && k < l->n; ++k)
+					l->frozen[k] = 1;
+			}
+			i += len - 1;
+			break;
+		case OPT_CODE:
+			if (OP(l->words[i]) == VM16_BEQ) {
+				lead_at(l, (long)i + 1 + im7(l->words[i]));
+				l->lead[i + 1] = 1;
+			} else if (OP(l->words[i]) == VM16_JALR) {
+				l->lead[i + 1] = 1;
+				/* Calls return two words on */
+				if (RD(l->words[i])) {
+					lead_at(l, (long)i + 2);
+				}
+			}
+			break;
+		}
+	}
+}
+
+/* Split the words into blocks and find the registers live at each */
+static void
+blocks(struct lay *l)
+{
+	struct block *b = NULL;
+	size_t i, j, k, e;
+	uint8_t out;
+	bool changed;
+	long t;
+
+	for (i = 0; i < l->n; ++i) {
+		if (i == 0 || l->lead[i]) {
+			b = &l->blk[l->nb++];
+			memset(b, 0, sizeof(*b));
+			b->start = i;
+			b->succ[0] = b->succ[1] = NONE;
+		}
+		b->end = i + 1;
+		l->bno[i] = l->nb - 1;
+		if (l->tags[i] == OPT_DATA) {
+			b->any = true;
+			b->use = ALL;
+		} else {
+			regs(b, l->words[i]);
+		}
+	}
+	l->bno[l->n] = l->nb;
+	for (k = 0; k < l->nb; ++k) {
+		b = &l->blk[k];
+		e = b->end - 1;
+		if (b->any) {
+			continue;
+		}
+		if (l->tags[e] == OPT_CODE && OP(l->words[e]) == VM16_BEQ) {
+			t = (long)e + 1 + im7(l->words[e]);
+			b->any = t < 0 || (size_t)t >= l->n;
+			b->succ[0] = b->any ? NONE : l->bno[t];
+			if (RD(l->words[e]) != R1(l->words[e])) {
+				b->succ[1] = l->bno[e + 1];
+			}
+		} else if (l->tags[e] == OPT_CODE && OP(l->words[e]) == VM16_JALR) {
+			/* Nothing runs after halt */
+			if (l->words[e] == vm16_orri(VM16_JALR, 0, 0, 0)) {
+				continue;
+			}
+			/* Calls come back through a jalr to anywhere */
+			j = jump_from(l, e, &t);
+			b->any = j == NONE || j < b->start || t < 0 ||
+			         (size_t)t >= l->n;
+			b->succ[0] = b->any ? NONE : l->bno[t];
+		} else {
+			b->succ[0] = l->bno[e + 1];
+		}
+	}
+	/* Falling off the end goes anywhere too */
+	do {
+		changed = false;
+		for (k = l->nb; k-- > 0;) {
+			b = &l->blk[k];
+			out = b->any ? ALL : 0;
+			for (i = 0; i < 2; ++i) {
+				if (b->succ[i] != NONE) {
+					out |= b->succ[i] == l->nb ? ALL : l->blk[b->succ[i]].live;
+				}
+			}
+			out = b->use | (out & ~b->def);
+			changed |= out != b->live;
+			b->live = out;
+		}
+	} while (changed);
+}
+
+/* Tell whether the jump ending a chain can go once its target follows it */
+static bool
+droppable(struct lay const *l, struct chain const *c)
+{
+	return c->target != NONE &&
+	       !(c->reg && l->blk[l->bno[c->target]].live & 1 << c->reg);
+}
+
+/* Tell whether a call returns to word i */
+static bool
+returns(struct lay const *l, size_t i)
+{
+	return i >= 2 && l->tags[i - 2] == OPT_CODE &&
+	       OP(l->words[i - 2]) == VM16_JALR && RD(l->words[i - 2]);
+}
+
+/* Split the words into chains and find the jump ending each */
+static void
+chains(struct lay *l)
+{
+	struct chain *c = NULL;
+	bool split = true;
+	size_t i, e, j;
+	uint16_t w;
+	long t;
+
+	for (i = 0; i < l->n; ++i) {
+		/* Words around data and calls with their returns stay together */
+		if (split && !(i && l->frozen[i - 1] && l->frozen[i]) &&
+		    !returns(l, i)) {
+			c = &l->ch[l->nc++];
+			memset(c, 0, sizeof(*c));
+			c->start = i;
+			c->next = c->prev = NONE;
+		}
+		l->cno[i] = l->nc - 1;
+		c->heat = l->count[i] > c->heat ? l->count[i] : c->heat;
+		/* Only jumps and halt end chains, everything else falls through */
+		w = l->words[i];
+		split = l->tags[i] == OPT_CODE &&
+		        ((OP(w) == VM16_JALR && !RD(w)) ||
+		         (OP(w) == VM16_BEQ && RD(w) == R1(w)));
+	}
+	l->tail = !split;
+	for (i = 0; i < l->nc; ++i) {
+		c = &l->ch[i];
+		c->end = i + 1 < l->nc ? l->ch[i + 1].start : l->n;
+		e = c->end - 1;
+		w = l->words[e];
+		c->jump = c->end;
+		c->target = NONE;
+		c->taken = l->count[e];
+		if (l->tags[e] != OPT_CODE) {
+			continue;
+		}
+		if (OP(w) == VM16_BEQ && RD(w) == R1(w)) {
+			t = (long)e + 1 + im7(w);
+			c->jump = e;
+		} else if (OP(w) == VM16_JALR && !RD(w)) {
+			j = jump_from(l, e, &t);
+			if (j == NONE || j < c->start) {
+				continue;
+			}
+			c->jump = j;
+			c->reg = RD(l->words[j]);
+		} else {
+			continue;
+		}
+		if (t < 0 || (size_t)t >= l->n || l->frozen[c->jump] || l->frozen[e]) {
+			continue;
+		}
+		/* Coming in past the la jumps wherever the register points */
+		for (j = c->jump + 1; j < c->end && !l->lead[j]; ++j)
+			;
+		if (j == c->end) {
+			c->target = t;
+		}
+	}
+}
+
+/* Sort highest keys first, then in program order */
+static int
+by_key(void const *a, void const *b)
+{
+	struct rank const *x = a, *y = b;
+
+	if (x->key != y->key) {
+		return x->key < y->key ? 1 : -1;
+	}
+	return x->chain < y->chain ? -1 : x->chain > y->chain;
+}
+
+/* Tell whether chain b follows chain a among the merged ones */
+static bool
+reaches(struct lay const *l, size_t a, size_t b)
+{
+	for (; a != NONE; a = l->ch[a].next) {
+		if (a == b) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Put each chain right before the one it jumps to, most taken jumps
+ * first, then place the merged chains hottest first after the entry. A
+ * last chain running off the end stays alone and last.
+ */
+static void
+arrange(struct lay *l)
+{
+	struct chain *c, *x;
+	size_t i, k, nr = 0, head;
+
+	for (i = 0; i < l->nc; ++i) {
+		c = &l->ch[i];
+		if (c->taken && droppable(l, c) && l->cno[c->target] != 0 &&
+		    l->ch[l->cno[c->target]].start == c->target) {
+			l->rank[nr].key = c->taken;
+			l->rank[nr++].chain = i;
+		}
+	}
+	qsort(l->rank, nr, sizeof(*l->rank), by_key);
+	for (i = 0; i < nr; ++i) {
+		c = &l->ch[l->rank[i].chain];
+		head = l->cno[c->target];
+		x = &l->ch[head];
+		/* Running off the end halts, so what does stays last */
+		if (l->tail && head == l->nc - 1) {
+			continue;
+		}
+		if (c->next == NONE && x->prev == NONE &&
+		    !reaches(l, head, l->rank[i].chain)) {
+			c->next = head;
+			x->prev = l->rank[i].chain;
+		}
+	}
+	nr = 0;
+	for (i = 0; i < l->nc; ++i) {
+		if (l->ch[i].prev != NONE) {
+			continue;
+		}
+		l->rank[nr].key = i == 0 ? UINT64_MAX : 0;
+		for (k = i; k != NONE && !(l->tail && i == l->nc - 1);
+		     k = l->ch[k].next) {
+			if (l->ch[k].heat > l->rank[nr].key) {
+				l->rank[nr].key = l->ch[k].heat;
+			}
+		}
+		l->rank[nr++].chain = i;
+	}
+	qsort(l->rank, nr, sizeof(*l->rank), by_key);
+	for (i = 0, k = 0; i < nr; ++i) {
+		for (head = l->rank[i].chain; head != NONE; head = l->ch[head].next)
+			l->order[k++] = head;
+	}
+}
+
+/* Give every word its index in the new order, dropped ones the next kept */
+static void
+place(struct lay *l)
+{
+	size_t i, k, pos = 0;
+	struct chain const *c;
+
+	for (k = 0; k < l->nc; ++k) {
+		c = &l->ch[l->order[k]];
+		for (i = c->start; i < c->end; ++i) {
+			l->map[i] = pos;
+			pos += l->keep[i];
+		}
+	}
+	l->map[l->n] = pos;
+}
+
+/* Drop words of jumps, returns how many times they were executed */
+static uint64_t
+drop(struct lay *l, size_t from, size_t to)
+{
+	uint64_t n = 0;
+
+	for (; from < to; ++from) {
+		l->keep[from] = 0;
+		n += l->count[from];
+	}
+	return n;
+}
+
+/* Where the word at address a went, the program end moves what follows */
+static uint16_t
+moved(struct lay const *l, uint16_t a)
+{
+	if (a < VM16_ADDR_START) {
+		return a;
+	}
+	if ((size_t)(a - VM16_ADDR_START) <= l->n) {
+		return VM16_ADDR_START + l->map[a - VM16_ADDR_START];
+	}
+	return a - (l->n - l->map[l->n]);
+}
+
+/* Write the words in their new order to out, false if a branch falls short */
+static bool
+emit(struct lay const *l, uint16_t *out)
+{
+	size_t i, k, gone = l->n - l->map[l->n];
+	struct chain const *c;
+	uint16_t w, a;
+	long t;
+
+	for (k = 0; k < l->nc; ++k) {
+		c = &l->ch[l->order[k]];
+		for (i = c->start; i < c->end; ++i) {
+			w = l->words[i];
+			if (!l->keep[i]) {
+				continue;
+			}
+			if (c->shrink && i == c->end - 1) {
+				t = (long)l->map[c->target] - (long)l->map[i] - 1;
+				if (!fits(t)) {
+					return false;
+				}
+				w = vm16_orri(VM16_BEQ, 0, 0, t & 0x7F);
+			} else if (l->tags[i] == OPT_CODE && OP(w) == VM16_BEQ) {
+				t = (long)i + 1 + im7(w);
+				t = t < 0 ? t : t > (long)l->n ? t - (long)gone
+				                               : (long)l->map[t];
+				t -= (long)l->map[i] + 1;
+				if (!fits(t)) {
+					return false;
+				}
+				w = (w & 0x1FF) | (t & 0x7F) << 9;
+			} else if (l->tags[i] == OPT_ADDR) {
+				/* Both words of a la, load or store stay in the same chain */
+				if (addr_of(l->words, i, &a) == 2) {
+					a = moved(l, a);
+					out[l->map[i]] = vm16_ori(VM16_LUI, RD(w), a >> 6);
+					out[l->map[i + 1]] = vm16_orri(OP(l->words[i + 1]),
+					                               RD(w), RD(w), a & 0x3F);
+					i += 1;
+					continue;
+				}
+				w = vm16_orri(OP(w), RD(w), 0, moved(l, a));
+			}
+			out[l->map[i]] = w;
+		}
+	}
+	return true;
+}
+
+size_t
+layout_run(uint16_t *words, uint8_t const *tags, size_t n, struct symtab *st,
+           uint64_t const *count, struct layout_stats *s)
+{
+	struct lay l;
+	uint64_t before = 0, saved = 0;
+	size_t i, k, removed = 0, shortened = 0, displaced = 0;
+	uint16_t *out = NULL;
+	struct chain *c;
+	long t;
+
+	memset(&l, 0, sizeof(l));
+	l.words = words;
+	l.tags = tags;
+	l.n = n;
+	l.count = count;
+	for (i = 0; i < n; ++i) {
+		before += count[i];
+		/* Code that knows where it is cannot move */
+		if (tags[i] == OPT_CODE && OP(words[i]) == VM16_AUIPC) {
+			log_warn("Code using auipc is left as is\n");
+			goto done;
+		}
+	}
+	l.lead = calloc(n + 1, 1);
+	l.frozen = calloc(n + 1, 1);
+	l.keep = malloc(n + 1);
+	l.bno = malloc(sizeof(*l.bno) * (n + 1));
+	l.cno = malloc(sizeof(*l.cno) * (n + 1));
+	l.map = malloc(sizeof(*l.map) * (n + 1));
+	l.order = malloc(sizeof(*l.order) * (n + 1));
+	l.blk = malloc(sizeof(*l.blk) * (n + 1));
+	l.ch = malloc(sizeof(*l.ch) * (n + 1));
+	l.rank = malloc(sizeof(*l.rank) * (n + 1));
+	out = malloc(sizeof(*out) * (n + 1));
+	if (!n || !l.lead || !l.frozen || !l.keep || !l.bno || !l.cno ||
+	    !l.map || !l.order || !l.blk || !l.ch || !l.rank || !out) {
+		goto done;
+	}
+	memset(l.keep, 1, n + 1);
+	leaders(&l, st);
+	blocks(&l);
+	chains(&l);
+	arrange(&l);
+
+	/* Drop jumps to the chain placed right after them */
+	for (k = 0; k < l.nc; ++k) {
+		displaced += l.order[k] != k;
+		c = &l.ch[l.order[k]];
+		if (k + 1 < l.nc && droppable(&l, c) &&
+		    c->target == l.ch[l.order[k + 1]].start) {
+			saved += drop(&l, c->jump, c->end);
+			removed += 1;
+		}
+	}
+	place(&l);
+	/* Jumps close enough to where they go need no register */
+	for (k = 0; k < l.nc; ++k) {
+		c = &l.ch[k];
+		if (!c->reg || !l.keep[c->jump] || !droppable(&l, c)) {
+			continue;
+		}
+		t = (long)l.map[c->target] - (long)l.map[c->jump] - 1;
+		if (fits(t)) {
+			saved += drop(&l, c->jump, c->end - 1);
+			c->shrink = true;
+			shortened += 1;
+		}
+	}
+	place(&l);
+	if (!emit(&l, out)) {
+		log_warn("Branches would not reach after layout, left as is\n");
+		saved = 0;
+		goto done;
+	}
+
+	memcpy(words, out, sizeof(*out) * l.map[n]);
+	for (i = 0; i < st->used; ++i)
+		st->sym[i].value = moved(&l, st->sym[i].value);
+	n = l.map[n];
+	s->removed += removed;
+	s->shortened += shortened;
+	s->moved += displaced;
+done:
+	s->before += before;
+	/* An estimate, the profile less what the dropped words ran */
+	s->after += before - saved;
+	free(l.lead);
+	free(l.frozen);
+	free(l.keep);
+	free(l.bno);
+	free(l.cno);
+	free(l.map);
+	free(l.order);
+	free(l.blk);
+	free(l.ch);
+	free(l.rank);
+	free(out);
+	return n;
+}
@@ -0,0 +1,39 @@
+/* See LICENSE file for copyright and license details */
+#ifndef LAYOUT_H__
+#define LAYOUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "symtab.h"
+
+/* What laying out a program by its profile changed */
+struct layout_stats {
+	uint64_t before;   /* Instructions executed in the profile */
+	uint64_t after;    /* Instructions the same run is estimated to take */
+	size_t removed;    /* Jumps to the block placed right after them */
+	size_t shortened;  /* la and jalr jumps turned into one BEQ */
+	size_t moved;      /* Chains of blocks placed elsewhere */
+};
+
+/*
+ * Reorder the blocks of n words assembled for VM16_ADDR_START, tagged as
+ * for opt_run, by count, how many times each word was executed. Blocks
+ * that fall through stay together in chains, each ending in a jump or
+ * halt, and calls stay with the words they return to. Chains whose jumps
+ * were taken most often are placed right before the chain they jump to,
+ * dropping the jump, and the rest follow hottest first so code that never
+ * ran ends up last. A chain running off the end of the program stays
+ * there, as running off the end halts. Jumps through la and jalr
+ * become one BEQ where the register loaded is dead and the target is
+ * close enough. Branch offsets, addresses of la, load and store, and the
+ * labels in st follow their words, and code near an address taken by
+ * anything but a jump is kept in place. Programs using AUIPC are left as
+ * they are, as are programs whose branches would not reach. Returns the
+ * number of words and adds to s.
+ */
+size_t
+layout_run(uint16_t *words, uint8_t const *tags, size_t n, struct symtab *st,
+           uint64_t const *count, struct layout_stats *s);
+
+#endif
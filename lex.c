@@ -1,5 +1,6 @@
 /* See LICENSE file for copyright and license details */
 #include <ctype.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,7 +10,7 @@
 #include "txt.h"
 #include "lex.h"
 
-/* Keywords defined by this lexer */
+/* Keywords defined by this lexer, the only table to update for new ones */
 struct {char const *bytes; token_k kind;} kw[] = {
 	/* Instructions */
 	{"lui", TOK_LUI},   {"auipc", TOK_AUIPC}, {"jalr", TOK_JALR},
@@ -26,25 +27,161 @@ struct {char const *bytes; token_k kind;} kw[] = {
 	{".word", TOK_WORD}, 
 };
 
+/* Slots of the keyword hash, a power of two well above the keyword count */
+#define KW_SLOTS 128
+
+/* Perfect hash of kw, found on first use by trying seeds */
+static uint32_t kwseed;
+static size_t kwmax;               /* Longest keyword */
+static uint8_t kwslot[KW_SLOTS];   /* Index into kw plus one, 0 for none */
+static pthread_once_t kwonce = PTHREAD_ONCE_INIT;
+
+static size_t
+kwhash(uint32_t seed, char const *s, size_t len)
+{
+	uint32_t h = seed ^ len;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return (h ^ h >> 16) & (KW_SLOTS - 1);
+}
+
+static void
+kwbuild(void)
+{
+	size_t i, k, n = sizeof(kw)/sizeof(*kw);
+
+	for (i = 0; i < n; ++i) {
+		if (strlen(kw[i].bytes) > kwmax)
+			kwmax = strlen(kw[i].bytes);
+	}
+	for (kwseed = 0;; ++kwseed) {
+		memset(kwslot, 0, sizeof(kwslot));
+		for (i = 0; i < n; ++i) {
+			k = kwhash(kwseed, kw[i].bytes, strlen(kw[i].bytes));
+			if (kwslot[k]) {
+				break;
+			}
+			kwslot[k] = i + 1;
+		}
+		if (i == n) {
+			return;
+		}
+	}
+}
+
+/* Classify an identifier with one hash and at most one compare */
+static token_k
+keyword(char const *s, size_t len)
+{
+	size_t k;
+
+	pthread_once(&kwonce, kwbuild);
+	if (len > kwmax) {
+		return TOK_IDENT;
+	}
+	k = kwslot[kwhash(kwseed, s, len)];
+	if (k-- && !strncmp(kw[k].bytes, s, len) && !kw[k].bytes[len]) {
+		return kw[k].kind;
+	}
+	return TOK_IDENT;
+}
+
+/* What a scan stops at */
+enum {
+	SCAN_SPACE, /* Anything but whitespace */
+	SCAN_EOL,   /* A newline or the terminator */
+	SCAN_STAR,  /* A '*' or the terminator */
+};
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Bit mask of the bytes of an aligned block that stop a scan */
+static inline unsigned
+stops(char const *b, int kind)
+{
+	__m128i x = _mm_load_si128((__m128i const *)b), t;
+
+	switch (kind) {
+	case SCAN_SPACE:
+		/* ' ' and '\t' to '\r', the bytes isspace accepts */
+		t = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+		t = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(4)), t);
+		t = _mm_or_si128(t, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+		return ~_mm_movemask_epi8(t) & 0xFFFF;
+	case SCAN_EOL:
+		t = _mm_cmpeq_epi8(x, _mm_set1_epi8('\n'));
+		break;
+	default:
+		t = _mm_cmpeq_epi8(x, _mm_set1_epi8('*'));
+		break;
+	}
+	t = _mm_or_si128(t, _mm_cmpeq_epi8(x, _mm_setzero_si128()));
+	return _mm_movemask_epi8(t);
+}
+
+/*
+ * Scan 16 bytes at a time. Aligned blocks never cross a page, so reading
+ * the rest of the block holding the terminator is safe.
+ */
+static inline char const *
+scan(char const *p, int kind)
+{
+	char const *b = (char const *)((uintptr_t)p & ~(uintptr_t)15);
+	unsigned m = stops(b, kind) & (0xFFFFu << (p - b));
+
+	while (!m) {
+		b += 16;
+		m = stops(b, kind);
+	}
+	return b + __builtin_ctz(m);
+}
+#else
+static inline char const *
+scan(char const *p, int kind)
+{
+	switch (kind) {
+	case SCAN_SPACE:
+		while (isspace((unsigned char)*p))
+			p += 1;
+		break;
+	case SCAN_EOL:
+		while (*p && *p != '\n')
+			p += 1;
+		break;
+	default:
+		while (*p && *p != '*')
+			p += 1;
+		break;
+	}
+	return p;
+}
+#endif
+
 /* Supports both kinds of C-style comments */
 static void
 strip_whitespace_and_comments(struct txt *in)
 {
-	while (txt_at(in)[0]) {
-		if (isspace(txt_at(in)[0])) {
-			txt_get(in);
-		} else if (txt_at(in)[0] == '/' && txt_at(in)[1] == '/') {
-			while (txt_at(in)[0] && '\n' != txt_at(in)[0])
-				txt_get(in);
-		} else if (txt_at(in)[0] == '/' && txt_at(in)[1] == '*') {
-			while (txt_at(in)[0] && !('*' == txt_at(in)[0] && '/' == txt_at(in)[1]))
-				txt_get(in);
-			txt_get(in);
-			txt_get(in);
+	char const *p = txt_at(in);
+
+	for (;;) {
+		p = scan(p, SCAN_SPACE);
+		if (p[0] == '/' && p[1] == '/') {
+			p = scan(p, SCAN_EOL);
+		} else if (p[0] == '/' && p[1] == '*') {
+			/* The '*' of the opening can also be the one of the closing */
+			p += 1;
+			while (*(p = scan(p, SCAN_STAR)) && p[1] != '/')
+				p += 1;
+			if (*p) {
+				p += 2;
+			}
 		} else {
 			break;
 		}
 	}
+	txt_seek(in, p);
 }
 
 static int 
@@ -95,11 +232,8 @@ lex(struct txt *in)
 {
 	char ch;
 	struct token rv;
-	size_t i;
 
 	strip_whitespace_and_comments(in);
-	rv.row = in->row;
-	rv.col = in->col;
 	rv.bytes = txt_at(in);
 	ch = txt_get(in);
 	switch (ch) {
@@ -132,14 +266,8 @@ lex(struct txt *in)
 	default:
 		while (!isdelim(txt_at(in)[0]) && isalnum(txt_at(in)[0]))
 			txt_get(in);
-		rv.kind = TOK_IDENT;
 		/* Check for special identifiers */
-		for (i = 0; i < sizeof(kw)/sizeof(*kw); ++i) {
-			if (txt_at(in) - rv.bytes == (long)strlen(kw[i].bytes)
-			&& !strncmp(kw[i].bytes, rv.bytes, txt_at(in) - rv.bytes)) {
-				rv.kind = kw[i].kind;
-			}
-		}
+		rv.kind = keyword(rv.bytes, txt_at(in) - rv.bytes);
 	}
 	rv.len = txt_at(in) - rv.bytes;
 	return rv;
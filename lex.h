@@ -53,9 +53,8 @@ typedef enum {
 	TOK_WORD,
 } token_k;
 
+/* Positions of tokens are found from bytes with txt_pos */
 struct token {
-	size_t row;
-	size_t col;
 	token_k kind;
 	size_t len;
 	char const *bytes;
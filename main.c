@@ -6,44 +6,266 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "aot.h"
 #include "arg.h"
+#include "batch.h"
+#include "cache.h"
 #include "gen.h"
+#include "icache.h"
+#include "img.h"
+#include "jit.h"
 #include "log.h"
+#include "obj.h"
+#include "prof.h"
+#include "sched.h"
+#include "sink.h"
+#include "source.h"
+#include "threaded.h"
 #include "vm16.h"
-#include "zone.h"
 
 char const *argv0;
 
-char *usage = "[-h] [-d] [-i <inpath>] [-o <outpath>] [file]\n";
+char *usage = "[-h] [-b <manifest>] [-c] [-d] [-e <engine>] [-i <inpath>] [-j <threads>] [-k <cachedir>] [-l <profile>] [-o <outpath>] [-O] [-p <profile>] [-r] [-s <steps>] [file | link <file>...]\n";
 
-static long
-flen(FILE *fp)
+/* Execution engines selectable with -e, the first one is the default */
+static struct engine {
+	char const *name;
+	void (*exec)(struct vm16 *);
+	void (*step)(struct vm16 *);
+	int (*run)(struct vm16 *, uint64_t);
+} engines[] = {
+	{"switch",   vm16_exec,          vm16_step,        vm16_run},
+	{"threaded", vm16_exec_threaded, vm16_step_cached, vm16_run_threaded},
+	{"cached",   vm16_exec_cached,   vm16_step_cached, vm16_run_cached},
+	{"jit",      vm16_exec_jit,      vm16_step,        vm16_run_jit},
+	/* Runs batch jobs of the same image side by side */
+	{"lockstep", NULL,               NULL,             NULL},
+};
+
+/* Instructions run between checks of a bounded run */
+#define SLICE (1u << 20)
+
+/* Run a machine for at most max instructions, waiting out blocked input */
+static void
+bounded(struct vm16 *v, uint64_t max, int (*run)(struct vm16 *, uint64_t))
+{
+	struct sched s;
+	struct sched_ctx c = {v, max, 0, 0, 0, 0, NULL};
+
+	if (!sched_init(&s, 1, SLICE, run)) {
+		log_fatal("Unable to start the scheduler\n");
+	}
+	sched_add(&s, &c);
+	sched_wait(&s);
+	sched_fini(&s);
+	if (c.status == VM16_FAULT) {
+		log_error("Device fault at pc 0x%x\n", v->pc);
+	} else if (c.status != VM16_HALTED) {
+		log_warn("Stopped after %llu instructions\n", (unsigned long long)c.used);
+	}
+}
+
+/* Run a loaded machine with stdin and stdout behind its devices */
+static void
+run(struct vm16 *v, struct engine const *e, bool dump, char const *budget)
+{
+	struct sink *sink = malloc(sizeof(*sink));
+	struct source *source = malloc(sizeof(*source));
+
+	sink_init_fd(sink, STDOUT_FILENO);
+	sink_attach(sink, v);
+	source_init_fd(source, STDIN_FILENO);
+	source_attach(source, v);
+
+	printf("==== begin program ====\n");
+	for (int i = 0; i < 32; ++i)
+		printf("0x%x\n", VM16_PEEK(v, VM16_ADDR_START + i));
+	printf("==== end program ====\n");
+	/* Guest output bypasses stdio from here on */
+	fflush(stdout);
+
+	if (dump) {
+		while (v->pc != VM16_ADDR_HALT) {
+			vm16_dump(stdout, v);
+			fflush(stdout);
+			e->step(v);
+			sink_flush(sink);
+			sleep(1);
+		}
+	} else if (budget) {
+		bounded(v, strtoull(budget, NULL, 0), e->run);
+	} else {
+		e->exec(v);
+	}
+	if (!sink_flush(sink)) {
+		log_error("Unable to write program output\n");
+	}
+	if (dump) {
+		log_info("%zu bytes of output\n", sink->count);
+	}
+	sink_fini(sink);
+	vm16_fini(v);
+	free(source);
+	free(sink);
+}
+
+/* Write the hit and miss counts of the image cache */
+static void
+report(FILE *out)
+{
+	struct cache_stats s = cache_stats();
+
+	fprintf(out, "cache: %llu hits, %llu misses, %llu stored, %llu errors\n",
+	        (unsigned long long)s.hits, (unsigned long long)s.misses,
+	        (unsigned long long)s.stores, (unsigned long long)s.errors);
+}
+
+/*
+ * Whether every image came from the assembler. Cache hits skip the
+ * optimizer and layout, so their counts would leave those images out.
+ */
+static bool
+fresh(void)
+{
+	return !cache_stats().hits;
+}
+
+/*
+ * Write what the optimizer removed. These are words of the image, how
+ * many instructions they save depends on how often they would have run.
+ */
+static void
+saved(FILE *out)
+{
+	fprintf(out, "optimized: %zu words removed, %zu nops, %zu lui, "
+	        "%zu li, %zu addi folded\n", optimized.words, optimized.nops,
+	        optimized.luis, optimized.lis, optimized.folds);
+}
+
+/* Write the instructions laying out by the profile saved */
+static void
+relaid(FILE *out)
+{
+	fprintf(out, "layout: %llu instructions profiled, about %llu laid out, "
+	        "%zu jumps removed, %zu shortened, %zu chains moved\n",
+	        (unsigned long long)reordered.before,
+	        (unsigned long long)reordered.after, reordered.removed,
+	        reordered.shortened, reordered.moved);
+}
+
+/* Run a machine counting executions per address, then write them out */
+static void
+profiled(struct vm16 *v, struct engine const *e, bool dump,
+         char const *budget, char const *path, uint16_t const *words,
+         size_t nwords)
 {
-	long size;
+	FILE *fp;
 
-	if (0 > fseek(fp, 0, SEEK_END)) {
-		return -1;
+	v->prof = calloc(VM16_MM_SIZE, sizeof(*v->prof));
+	if (!v->prof) {
+		log_fatal("Out of memory\n");
+	}
+	run(v, e, dump, budget);
+	fp = fopen(path, "w");
+	if (!fp) {
+		log_fatal("Unable to open '%s'\n", path);
+	}
+	if (!prof_write(fp, v->prof, words, nwords)) {
+		fclose(fp);
+		log_fatal("Unable to write '%s'\n", path);
 	}
-	size = ftell(fp);
-	if (0 > size) {
-		return -1;
+	if (fclose(fp)) {
+		log_fatal("Unable to write '%s'\n", path);
 	}
-	rewind(fp);
+	free(v->prof);
+	v->prof = NULL;
+}
+
+/* Run every job of a manifest and write out what each one printed */
+static void
+batch(char const *manifest, char const *cache, size_t nthreads,
+      struct engine const *e, char const *budget)
+{
+	struct batch_job *jobs;
+	size_t njobs, i;
+	FILE *fp;
 
-	return size;
+	if (!batch_load(manifest, cache, &jobs, &njobs)) {
+		exit(1);
+	}
+	if (!njobs) {
+		return;
+	}
+	if (!batch_run(jobs, njobs, nthreads, e->exec, e->run,
+	               budget ? strtoull(budget, NULL, 0) : 0)) {
+		log_warn("Unable to start every worker thread\n");
+	}
+	for (i = 0; i < njobs; ++i) {
+		if (!jobs[i].output) {
+			printf("==== job %zu: %s ====\n", i, jobs[i].image);
+			fwrite(jobs[i].out, 1, jobs[i].outlen, stdout);
+			continue;
+		}
+		fp = fopen(jobs[i].output, "w");
+		if (!fp) {
+			log_error("Unable to open '%s'\n", jobs[i].output);
+			continue;
+		}
+		fwrite(jobs[i].out, 1, jobs[i].outlen, fp);
+		if (fclose(fp)) {
+			log_error("Unable to write '%s'\n", jobs[i].output);
+		}
+	}
+	fflush(stdout);
+	batch_report(stderr, jobs, njobs);
+	if (cache) {
+		report(stderr);
+	}
+	if (optimize && fresh()) {
+		saved(stderr);
+	}
+	if (profile && fresh()) {
+		relaid(stderr);
+	}
+	batch_free(jobs, njobs);
 }
 
-static char *
-strff(FILE *fp)
+/* Link objects and sources into an image, assembling sources in parallel */
+static void
+linker(char **paths, char const *outpath, size_t nthreads)
 {
-	size_t len;
-	char *buf;
-
-	len = flen(fp);
-	buf = zone_alloc((len + 1));
-	fread(buf, 1, len, fp);
-	buf[len] = '\0';
-	return buf;
+	uint16_t out[VM16_MM_SIZE];
+	struct obj *objs;
+	struct symtab *st;
+	size_t n, i, nwords;
+	FILE *fp;
+
+	for (n = 0; paths[n]; ++n)
+		;
+	objs = calloc(n + 1, sizeof(*objs));
+	st = symtab_create(1024);
+	if (!objs || !st) {
+		log_fatal("Out of memory\n");
+	}
+	if (!obj_load_all(objs, paths, n, nthreads) ||
+	    !obj_link(objs, n, out, &nwords, st)) {
+		exit(1);
+	}
+	fp = fopen(outpath, "w");
+	if (!fp) {
+		log_fatal("Unable to open '%s'\n", outpath);
+	}
+	if (!img_write(fp, out, nwords, st)) {
+		fclose(fp);
+		log_fatal("Unable to write '%s'\n", outpath);
+	}
+	if (fclose(fp)) {
+		log_fatal("Unable to write '%s'\n", outpath);
+	}
+	for (i = 0; i < n; ++i)
+		obj_free(&objs[i]);
+	free(objs);
+	symtab_destroy(st);
 }
 
 int
@@ -53,7 +275,19 @@ main(int argc, char **argv)
 	char *inpath = NULL;
 	char *outpath = NULL;
 	char *runpath = NULL;
+	char *engine = NULL;
+	char *manifest = NULL;
+	char *threads = NULL;
+	char *budget = NULL;
+	char *cache = NULL;
+	char *profpath = NULL;
+	char *layout = NULL;
+	static struct prof prof;
+	size_t e = 0;
 	bool dump = false;
+	bool translate = false;
+	bool relocatable = false;
+	struct vm16 *v;
 
 	argv0 = argv[0];
 	argv += 1;
@@ -71,15 +305,66 @@ main(int argc, char **argv)
 			log_fatal("No input file provided for -i\n");
 		}
 		break;
+	case 'j':
+		threads = ARGP(argv);
+		if (!threads || atoi(threads) < 1) {
+			log_fatal("No thread count provided for -j\n");
+		}
+		break;
+	case 'k':
+		cache = ARGP(argv);
+		if (!cache) {
+			log_fatal("No cache directory provided for -k\n");
+		}
+		break;
 	case 'o':
 		outpath = ARGP(argv);
 		if (!outpath) {
 			log_fatal("No output file provided for -o\n");
 		}
 		break;
+	case 's':
+		budget = ARGP(argv);
+		if (!budget || strtoull(budget, NULL, 0) < 1) {
+			log_fatal("No instruction count provided for -s\n");
+		}
+		break;
+	case 'b':
+		manifest = ARGP(argv);
+		if (!manifest) {
+			log_fatal("No manifest provided for -b\n");
+		}
+		break;
+	case 'c':
+		translate = true;
+		continue;
 	case 'd':
 		dump = true;
 		continue;
+	case 'r':
+		relocatable = true;
+		continue;
+	case 'O':
+		optimize = true;
+		continue;
+	case 'l':
+		layout = ARGP(argv);
+		if (!layout) {
+			log_fatal("No profile provided for -l\n");
+		}
+		break;
+	case 'p':
+		profpath = ARGP(argv);
+		if (!profpath) {
+			log_fatal("No profile provided for -p\n");
+		}
+		break;
+	case 'e':
+		engine = ARGP(argv);
+		if (!engine) {
+			log_fatal("No engine provided for -e\n");
+		}
+		break;
 	case '-':
 		ARGT(argv);
 		break;
@@ -89,49 +374,147 @@ main(int argc, char **argv)
 
 	runpath = argv[0];
 
-	if (!outpath) {
-		outpath = "a.out";
+	if (runpath && !strcmp(runpath, "link")) {
+		linker(argv + 1, outpath ? outpath : "a.img",
+		     threads ? atoi(threads) : sysconf(_SC_NPROCESSORS_ONLN));
+		return 0;
+	}
+
+	if (engine) {
+		for (e = 0; e < sizeof(engines)/sizeof(*engines); ++e) {
+			if (!strcmp(engines[e].name, engine))
+				break;
+		}
+		if (e == sizeof(engines)/sizeof(*engines)) {
+			log_fatal("Unknown engine '%s', try '%s -h'\n", engine, argv0);
+		}
+	}
+
+	if (!engines[e].exec && (!manifest || inpath || runpath)) {
+		log_fatal("Engine '%s' only runs batches\n", engines[e].name);
+	}
+
+	/* Only the switch engine steps through vm16_step, which counts */
+	if (profpath) {
+		if (!inpath) {
+			log_fatal("Profiles are only taken of sources run with -i\n");
+		}
+		if (engine && strcmp(engine, "switch")) {
+			log_fatal("Profiles are only taken with engine 'switch'\n");
+		}
+	}
+
+	if (layout) {
+		if (!prof_read(&prof, layout)) {
+			exit(1);
+		}
+		profile = &prof;
+	}
+
+	if (manifest) {
+		batch(manifest, cache,
+		      threads ? atoi(threads) : sysconf(_SC_NPROCESSORS_ONLN),
+		      &engines[e], budget);
 	}
 
 	if (inpath) {
 		FILE *fp;
 		struct txt in;
 		uint16_t out[VM16_MM_SIZE];
-		struct vm16 *v = malloc(sizeof(*v));
 		size_t nwords;
 
-		fp = fopen(inpath, "ro");
-		if (!fp) {
-			log_fatal("Unable to open '%s'\n", inpath);
+		/* Write a relocatable object to link later */
+		if (relocatable) {
+			struct obj o;
+
+			if (!txt_open(&in, inpath)) {
+				log_fatal("Unable to open '%s'\n", inpath);
+			}
+			assemble_obj(&in, &o);
+			if (!outpath) {
+				outpath = "a.o";
+			}
+			fp = fopen(outpath, "w");
+			if (!fp) {
+				log_fatal("Unable to open '%s'\n", outpath);
+			}
+			if (!obj_write(fp, &o)) {
+				fclose(fp);
+				log_fatal("Unable to write '%s'\n", outpath);
+			}
+			if (fclose(fp)) {
+				log_fatal("Unable to write '%s'\n", outpath);
+			}
+			obj_free(&o);
+			return 0;
 		}
 
-		txt_init(&in, inpath, strff(fp));
-		fclose(fp);
+		/* Images written with -o carry labels, which cache hits do not rebuild */
+		if (cache && !outpath) {
+			nwords = cache_assemble(cache, inpath, out);
+			if (dump) {
+				report(stdout);
+			}
+		} else {
+			/* Labels point into the source, so it stays open */
+			if (!txt_open(&in, inpath)) {
+				log_fatal("Unable to open '%s'\n", inpath);
+			}
+			nwords = assemble(&in, out);
+		}
+		if (optimize && fresh()) {
+			saved(stderr);
+		}
+		if (profile && fresh()) {
+			relaid(stderr);
+		}
 
-		nwords = assemble(&in, out);
+		/* Translate the program to C or write its image instead of running it */
+		if (translate || outpath) {
+			if (!outpath) {
+				outpath = "a.c";
+			}
+			fp = fopen(outpath, "w");
+			if (!fp) {
+				log_fatal("Unable to open '%s'\n", outpath);
+			}
+			if (translate ? !aot_emit(fp, inpath, out, nwords)
+			              : !img_write(fp, out, nwords, symtab)) {
+				fclose(fp);
+				log_fatal("Unable to write '%s'\n", outpath);
+			}
+			if (fclose(fp)) {
+				log_fatal("Unable to write '%s'\n", outpath);
+			}
+			return 0;
+		}
 
+		v = malloc(sizeof(*v));
 		vm16_init(v);
 		vm16_load(v, out, nwords);
-
-		printf("==== begin program ====\n");
-		for (int i = 0; i < 32; ++i)
-			printf("0x%x\n", out[i]);
-		printf("==== end program ====\n");
-
-		if (dump) {
-			while (v->pc != VM16_ADDR_HALT) {
-				vm16_dump(stdout, v);
-				vm16_step(v);
-				sleep(1);
-			}
+		if (profpath) {
+			profiled(v, &engines[e], dump, budget, profpath, out, nwords);
 		} else {
-			vm16_exec(v);
+			run(v, &engines[e], dump, budget);
 		}
 		free(v);
 	}
 
+	/* Run an image written with -o, which needs no assembling */
 	if (runpath) {
-		/* Now run the assembled program */
+		struct img im;
+
+		if (!img_open(&im, runpath)) {
+			exit(1);
+		}
+		v = malloc(sizeof(*v));
+		vm16_init(v);
+		if (!img_load(&im, v)) {
+			log_fatal("Unable to load '%s'\n", runpath);
+		}
+		img_close(&im);
+		run(v, &engines[e], dump, budget);
+		free(v);
 	}
 
 	return 0;
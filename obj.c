@@ -0,0 +1,293 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gen.h"
+#include "lex.h"
+#include "log.h"
+#include "obj.h"
+#include "symtab.h"
+#include "txt.h"
+#include "vm16.h"
+
+static uint16_t
+get16(unsigned char const *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t
+get32(unsigned char const *p)
+{
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static void
+put16(unsigned char *p, uint16_t w)
+{
+	p[0] = w & 0xFF;
+	p[1] = w >> 8;
+}
+
+static void
+put32(unsigned char *p, uint32_t w)
+{
+	put16(p, w & 0xFFFF);
+	put16(p + 2, w >> 16);
+}
+
+bool
+obj_write(FILE *out, struct obj const *o)
+{
+	unsigned char hdr[OBJ_HDR_SIZE], b[8];
+	size_t i;
+
+	memcpy(hdr, OBJ_MAGIC, 4);
+	put16(hdr + 4, OBJ_VERSION);
+	put16(hdr + 6, 0);
+	put32(hdr + 8, o->nwords);
+	put32(hdr + 12, o->nreloc);
+	put32(hdr + 16, o->nsym);
+	fwrite(hdr, 1, sizeof(hdr), out);
+	for (i = 0; i < o->nwords; ++i) {
+		put16(b, o->words[i]);
+		fwrite(b, 1, 2, out);
+	}
+	for (i = 0; i < o->nreloc; ++i) {
+		put16(b, o->reloc[i].idx);
+		put16(b + 2, o->reloc[i].sym);
+		put16(b + 4, o->reloc[i].opcode);
+		put16(b + 6, o->reloc[i].rd);
+		fwrite(b, 1, 8, out);
+	}
+	for (i = 0; i < o->nsym; ++i) {
+		put16(b, o->sym[i].value);
+		put16(b + 2, o->sym[i].flags);
+		put16(b + 4, o->sym[i].len);
+		fwrite(b, 1, 6, out);
+		fwrite(o->sym[i].name, 1, o->sym[i].len, out);
+	}
+	return !ferror(out);
+}
+
+/* Decode and check an object read into memory */
+static bool
+parse(struct obj *o, unsigned char const *p, size_t len)
+{
+	size_t i, off, end;
+	char *names;
+
+	if (len < OBJ_HDR_SIZE || get16(p + 4) != OBJ_VERSION) {
+		return false;
+	}
+	o->nwords = get32(p + 8);
+	o->nreloc = get32(p + 12);
+	o->nsym = get32(p + 16);
+	off = OBJ_HDR_SIZE + 2 * o->nwords + 8 * o->nreloc;
+	if (o->nwords > VM16_MM_SIZE || o->nreloc > o->nwords ||
+	    o->nsym > UINT16_MAX || off > len) {
+		return false;
+	}
+	o->words = malloc(sizeof(*o->words) * (o->nwords + 1));
+	o->reloc = malloc(sizeof(*o->reloc) * (o->nreloc + 1));
+	o->sym = malloc(sizeof(*o->sym) * (o->nsym + 1));
+	o->names = names = malloc(len - off + 1);
+	if (!o->words || !o->reloc || !o->sym || !names) {
+		return false;
+	}
+	for (i = 0; i < o->nwords; ++i)
+		o->words[i] = get16(p + OBJ_HDR_SIZE + 2 * i);
+	for (i = 0; i < o->nsym; ++i) {
+		if (off + 6 > len || off + 6 + get16(p + off + 4) > len) {
+			return false;
+		}
+		o->sym[i].value = get16(p + off);
+		o->sym[i].flags = get16(p + off + 2);
+		o->sym[i].len = get16(p + off + 4);
+		o->sym[i].name = names;
+		memcpy(names, p + off + 6, o->sym[i].len);
+		names += o->sym[i].len;
+		off += 6 + o->sym[i].len;
+	}
+	/* The linker walks relocations along with the words */
+	for (i = 0, end = 0; i < o->nreloc; ++i) {
+		unsigned char const *r = p + OBJ_HDR_SIZE + 2 * o->nwords + 8 * i;
+
+		o->reloc[i].idx = get16(r);
+		o->reloc[i].sym = get16(r + 2);
+		o->reloc[i].opcode = get16(r + 4);
+		o->reloc[i].rd = get16(r + 6);
+		if ((i && o->reloc[i].idx <= end) || o->reloc[i].idx >= o->nwords ||
+		    o->reloc[i].sym >= o->nsym || o->reloc[i].rd > 7 ||
+		    (o->reloc[i].opcode != VM16_ADDI &&
+		     o->reloc[i].opcode != VM16_LW &&
+		     o->reloc[i].opcode != VM16_SW)) {
+			return false;
+		}
+		end = o->reloc[i].idx;
+	}
+	return true;
+}
+
+bool
+obj_load(struct obj *o, char const *path)
+{
+	struct txt in;
+
+	memset(o, 0, sizeof(*o));
+	if (!txt_open(&in, path)) {
+		log_error("Unable to read '%s'\n", path);
+		return false;
+	}
+	if (in.len < 4 || memcmp(in.str, OBJ_MAGIC, 4)) {
+		/* Symbol names are copied out of the source */
+		assemble_obj(&in, o);
+		txt_close(&in);
+		return true;
+	}
+	o->path = path;
+	if (!parse(o, (unsigned char const *)in.str, in.len)) {
+		log_error("Invalid object '%s'\n", path);
+		txt_close(&in);
+		obj_free(o);
+		return false;
+	}
+	txt_close(&in);
+	return true;
+}
+
+/* Label of an object symbol, as the symbol table looks it up */
+static struct token
+label(struct obj_sym const *s)
+{
+	struct token t;
+
+	t.kind = TOK_IDENT;
+	t.len = s->len;
+	t.bytes = s->name;
+	return t;
+}
+
+bool
+obj_link(struct obj const *objs, size_t n, uint16_t out[VM16_MM_SIZE],
+         size_t *nwords, struct symtab *st)
+{
+	size_t i, j, r, base, pos = 0;
+	struct obj_sym const *s;
+	struct token t;
+	uint16_t *v, addr;
+	bool ok = true;
+
+	/* Objects start where the words before them would as one source */
+	for (i = 0, base = VM16_ADDR_START; i < n; base += objs[i++].nwords) {
+		for (j = 0; j < objs[i].nsym; ++j) {
+			s = &objs[i].sym[j];
+			if (!(s->flags & OBJ_DEFINED)) {
+				continue;
+			}
+			t = label(s);
+			if (symtab_at(st, &t)) {
+				log_error("Symbol '%.*s' of '%s' is already defined\n",
+				          (int)s->len, s->name, objs[i].path);
+				ok = false;
+				continue;
+			}
+			v = symtab_getv(st, &t);
+			if (!v) {
+				log_fatal("Out of memory\n");
+			}
+			*v = base + s->value;
+		}
+	}
+	if (base > VM16_MM_SIZE) {
+		log_error("Program too large\n");
+		return false;
+	}
+	for (i = 0, base = VM16_ADDR_START; i < n; base += objs[i++].nwords) {
+		for (j = 0, r = 0; j < objs[i].nwords; ++j) {
+			if (pos + 2 > VM16_MM_SIZE - VM16_ADDR_START) {
+				log_error("Program too large\n");
+				return false;
+			}
+			if (r == objs[i].nreloc || objs[i].reloc[r].idx != j) {
+				out[pos++] = objs[i].words[j];
+				continue;
+			}
+			s = &objs[i].sym[objs[i].reloc[r].sym];
+			t = label(s);
+			if (s->flags & OBJ_DEFINED) {
+				addr = base + s->value;
+			} else if ((v = symtab_at(st, &t))) {
+				addr = *v;
+			} else {
+				log_error("Undefined symbol '%.*s' in '%s'\n",
+				          (int)s->len, s->name, objs[i].path);
+				ok = false;
+				addr = 0;
+			}
+			pos += expand(&out[pos], objs[i].reloc[r].opcode,
+			              objs[i].reloc[r].rd, addr);
+			r += 1;
+		}
+	}
+	*nwords = pos;
+	return ok;
+}
+
+struct loader {
+	struct obj *objs;
+	char **paths;
+	size_t n;
+	size_t next;   /* Next object to load, taken atomically */
+	bool ok;
+};
+
+static void *
+loader(void *arg)
+{
+	struct loader *l = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED)) < l->n) {
+		if (!obj_load(&l->objs[i], l->paths[i]))
+			__atomic_store_n(&l->ok, false, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+bool
+obj_load_all(struct obj *objs, char **paths, size_t n, size_t nthreads)
+{
+	struct loader l = {objs, paths, n, 0, true};
+	pthread_t *tids;
+	size_t i, k = 0;
+
+	if (nthreads > n) {
+		nthreads = n;
+	}
+	tids = malloc(sizeof(*tids) * (nthreads + 1));
+	for (i = 0; tids && i + 1 < nthreads; ++i) {
+		if (!pthread_create(&tids[k], NULL, loader, &l))
+			k += 1;
+	}
+	/* The calling thread loads too, so a failed start only slows down */
+	loader(&l);
+	for (i = 0; i < k; ++i)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	return l.ok;
+}
+
+void
+obj_free(struct obj *o)
+{
+	free(o->words);
+	free(o->reloc);
+	free(o->sym);
+	free(o->names);
+	memset(o, 0, sizeof(*o));
+}
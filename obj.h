@@ -0,0 +1,97 @@
+/* See LICENSE file for copyright and license details */
+#ifndef OBJ_H__
+#define OBJ_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "symtab.h"
+#include "vm16.h"
+
+/*
+ * Relocatable objects hold a source assembled on its own. Every la, load
+ * and store of a label takes one word, which the linker widens to two
+ * where the address of the label needs it, exactly as a single source is
+ * assembled. Labels are exported, labels used but not defined are
+ * imported. All fields are little-endian. An object starts with a header:
+ *
+ *   0   4  magic, "VMOB"
+ *   4   2  version, OBJ_VERSION
+ *   6   2  zero
+ *   8   4  number of words
+ *   12  4  number of relocations
+ *   16  4  number of symbols
+ *
+ * followed by the words, 2 bytes each, and the relocations, 8 bytes each:
+ *
+ *   0   2  index of the word
+ *   2   2  index of the symbol
+ *   4   2  opcode, VM16_ADDI for la, VM16_LW for load or VM16_SW for store
+ *   6   2  register
+ *
+ * Symbols are a 2 byte value, 2 bytes of flags and a 2 byte name length,
+ * then the name. Values of defined symbols count words from the start of
+ * the object. An object holds at most UINT16_MAX symbols.
+ */
+#define OBJ_MAGIC    "VMOB"
+#define OBJ_VERSION  1
+#define OBJ_HDR_SIZE 20
+
+/* Flags of symbols */
+#define OBJ_DEFINED 0x1
+
+struct obj_reloc {
+	uint16_t idx;
+	uint16_t sym;
+	uint16_t opcode;
+	uint16_t rd;
+};
+
+struct obj_sym {
+	char const *name;
+	uint16_t len;
+	uint16_t value;
+	uint16_t flags;
+};
+
+struct obj {
+	char const *path;
+	uint16_t *words;
+	size_t nwords;
+	struct obj_reloc *reloc;  /* In order of words */
+	size_t nreloc;
+	struct obj_sym *sym;
+	size_t nsym;
+	char *names;              /* Bytes of the symbol names */
+};
+
+/* Write an object, returns false on write errors */
+bool
+obj_write(FILE *out, struct obj const *o);
+
+/*
+ * Read the object at path, or assemble it when path is a source. Returns
+ * false when it cannot be read.
+ */
+bool
+obj_load(struct obj *o, char const *path);
+
+/* Load objects like obj_load on up to nthreads threads at once */
+bool
+obj_load_all(struct obj *objs, char **paths, size_t n, size_t nthreads);
+
+/*
+ * Lay objects out one after the other from VM16_ADDR_START, resolve their
+ * symbols and widen what they reference. Labels are added to st. Returns
+ * false on undefined or duplicate symbols and programs too large.
+ */
+bool
+obj_link(struct obj const *objs, size_t n, uint16_t out[VM16_MM_SIZE],
+         size_t *nwords, struct symtab *st);
+
+void
+obj_free(struct obj *o);
+
+#endif
@@ -0,0 +1,320 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "opt.h"
+#include "symtab.h"
+#include "vm16.h"
+
+#define OP(w)   ((w) & 0x7)
+#define RD(w)   ((w) >> 3 & 0x7)
+#define R1(w)   ((w) >> 6 & 0x7)
+#define IM10(w) ((w) >> 6)
+
+/* Kinds of block leaders */
+#define LEAD  0x1 /* Control may arrive from elsewhere */
+#define TAKEN 0x2 /* Addressed by la, load or store, its block is kept */
+#define HOLE  0x4 /* Skipped by the return of the call before it, kept */
+
+/* Registers whose values are known at some point of a block */
+struct regs {
+	bool known[8];
+	uint16_t val[8];
+};
+
+static int
+im7(uint16_t w)
+{
+	int im = w >> 9;
+
+	return im & 0x40 ? im - 0x80 : im;
+}
+
+static bool
+fits(int d)
+{
+	return d >= -64 && d <= 63;
+}
+
+static void
+reset(struct regs *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->known[0] = true;
+}
+
+static void
+learn(struct regs *r, uint16_t rd, bool known, uint16_t val)
+{
+	if (rd) {
+		r->known[rd] = known;
+		r->val[rd] = val;
+	}
+}
+
+/* Decode the address of the la, load or store at word i, returns its length */
+static size_t
+addr_of(uint16_t const *words, size_t i, uint16_t *a)
+{
+	if (OP(words[i]) == VM16_LUI) {
+		*a = IM10(words[i]) << 6 | (words[i + 1] >> 9 & 0x3F);
+		return 2;
+	}
+	*a = words[i] >> 9 & 0x7F;
+	return 1;
+}
+
+static void
+lead_at(uint8_t *lead, size_t n, long p, uint8_t kind)
+{
+	if (p >= 0 && (size_t)p <= n) {
+		lead[p] |= kind;
+	}
+}
+
+/* Mark the words control may reach other than from the word before */
+static void
+leaders(uint16_t const *words, uint8_t const *tags, size_t n,
+        struct symtab const *st, uint8_t *lead)
+{
+	size_t i;
+	uint16_t a;
+
+	lead[0] = LEAD;
+	for (i = 0; i < st->used; ++i)
+		lead_at(lead, n, (long)st->sym[i].value - VM16_ADDR_START, LEAD);
+	for (i = 0; i < n; ++i) {
+		switch (tags[i]) {
+		case OPT_DATA:
+			lead[i + 1] |= LEAD;
+			break;
+		case OPT_ADDR:
+			i += addr_of(words, i, &a) - 1;
+			lead_at(lead, n, (long)a - VM16_ADDR_START, LEAD | TAKEN);
+			break;
+		case OPT_CODE:
+			if (OP(words[i]) == VM16_BEQ) {
+				lead_at(lead, n, (long)i + 1 + im7(words[i]), LEAD);
+			} else if (OP(words[i]) == VM16_JALR) {
+				lead[i + 1] |= LEAD;
+				/* Calls return two words on, the word between stays put */
+				if (RD(words[i]) && i + 1 < n) {
+					lead[i + 1] |= HOLE;
+					lead[i + 2] |= LEAD;
+				}
+			}
+			break;
+		}
+	}
+}
+
+/* Turn a two word li into one ADDI from a register holding a close value */
+static void
+shorten(uint16_t *words, uint8_t *keep, size_t i, struct regs *r,
+        struct opt_stats *s)
+{
+	uint16_t rd = RD(words[i]);
+	uint16_t v = IM10(words[i]) << 6 | (words[i + 1] >> 9 & 0x3F);
+	size_t k;
+
+	for (k = 0; k < 8 && !(r->known[k] && fits((int16_t)(v - r->val[k]))); ++k)
+		;
+	if (k == 8) {
+		return;
+	}
+	if (k == rd && r->val[k] == v) {
+		keep[i] = keep[i + 1] = 0;
+		s->words += 2;
+	} else {
+		words[i] = vm16_orri(VM16_ADDI, rd, k, (int16_t)(v - r->val[k]) & 0x7F);
+		keep[i + 1] = 0;
+		s->words += 1;
+	}
+	s->lis += 1;
+}
+
+/* Drop and rewrite words with what is known about registers in each block */
+static void
+simplify(uint16_t *words, uint8_t const *tags, size_t n,
+         uint8_t const *lead, uint8_t *keep, struct opt_stats *s)
+{
+	uint16_t const nop = vm16_orri(VM16_ADDI, 0, 0, 0);
+	size_t i, last = n;   /* ADDI a next one may fold into, n for none */
+	bool frozen = false;
+	struct regs r;
+	uint16_t w, rd, v;
+	int sum;
+
+	reset(&r);
+	for (i = 0; i < n; ++i) {
+		w = words[i];
+		rd = RD(w);
+		if (lead[i]) {
+			/* Words after an address the program takes may be read or patched */
+			frozen = lead[i] & (TAKEN | HOLE);
+			reset(&r);
+			last = n;
+		}
+		if (frozen || tags[i] == OPT_DATA) {
+			reset(&r);
+			last = n;
+			continue;
+		}
+		switch (tags[i]) {
+		case OPT_ADDR:
+			/* Addresses move with the words, so their values are not learned */
+			i += OP(w) == VM16_LUI;
+			learn(&r, rd, false, 0);
+			last = n;
+			continue;
+		case OPT_LI_HI:
+			if (lead[i + 1] || !rd) {
+				break;
+			}
+			v = IM10(w) << 6 | (words[i + 1] >> 9 & 0x3F);
+			shorten(words, keep, i, &r, s);
+			learn(&r, rd, true, v);
+			last = n;
+			i += 1;
+			continue;
+		case OPT_CODE:
+			if (w == nop) {
+				keep[i] = 0;
+				s->nops += 1;
+				s->words += 1;
+				continue;
+			}
+			break;
+		}
+		switch (OP(w)) {
+		case VM16_LUI:
+			v = IM10(w) << 6;
+			if (tags[i] == OPT_CODE && rd && r.known[rd] && r.val[rd] == v) {
+				keep[i] = 0;
+				s->luis += 1;
+				s->words += 1;
+				continue;
+			}
+			learn(&r, rd, true, v);
+			last = n;
+			break;
+		case VM16_ADDI:
+			learn(&r, rd, r.known[R1(w)], r.val[R1(w)] + im7(w));
+			if (tags[i] != OPT_CODE || !rd || rd != R1(w)) {
+				last = n;
+				break;
+			}
+			sum = 64;
+			if (last < n && RD(words[last]) == rd) {
+				sum = im7(words[last]) + im7(w);
+			}
+			if (!fits(sum)) {
+				last = i;
+				break;
+			}
+			keep[i] = 0;
+			s->folds += 1;
+			s->words += 1;
+			if (sum || lead[last]) {
+				words[last] = vm16_orri(VM16_ADDI, rd, rd, sum & 0x7F);
+			} else {
+				keep[last] = 0;
+				s->words += 1;
+				last = n;
+			}
+			break;
+		case VM16_JALR:
+			reset(&r);
+			last = n;
+			break;
+		case VM16_BEQ:
+		case VM16_SW:
+			last = n;
+			break;
+		default:
+			learn(&r, rd, false, 0);
+			last = n;
+			break;
+		}
+	}
+}
+
+size_t
+opt_run(uint16_t *words, uint8_t *tags, size_t n, struct symtab *st,
+        struct opt_stats *s)
+{
+	uint8_t *lead, *keep;
+	size_t *map;
+	size_t i, k, len, gone;
+	uint16_t a, w;
+	long t;
+
+	/* Code that knows where it is cannot move */
+	for (i = 0; i < n; ++i) {
+		if (tags[i] == OPT_CODE && OP(words[i]) == VM16_AUIPC) {
+			log_warn("Code using auipc is left as is\n");
+			return n;
+		}
+	}
+	lead = calloc(n + 1, 1);
+	keep = malloc(n + 1);
+	map = malloc(sizeof(*map) * (n + 1));
+	if (!lead || !keep || !map) {
+		free(lead);
+		free(keep);
+		free(map);
+		return n;
+	}
+	memset(keep, 1, n + 1);
+	leaders(words, tags, n, st, lead);
+	simplify(words, tags, n, lead, keep, s);
+
+	/* Removed words map to the next word kept */
+	for (i = 0, k = 0; i < n; ++i) {
+		map[i] = k;
+		k += keep[i];
+	}
+	map[n] = k;
+	gone = n - k;
+#define MOVED(a) ((a) < VM16_ADDR_START ? (a) : \
+	(size_t)((a) - VM16_ADDR_START) <= n ? \
+	VM16_ADDR_START + map[(a) - VM16_ADDR_START] : (a) - gone)
+
+	for (i = 0; i < n; ++i) {
+		w = words[i];
+		if (tags[i] == OPT_CODE && OP(w) == VM16_BEQ && keep[i]) {
+			t = (long)i + 1 + im7(w);
+			t = t < 0 ? t : t > (long)n ? t - (long)gone : (long)map[t];
+			words[i] = (w & 0x1FF) | ((t - (long)map[i] - 1) & 0x7F) << 9;
+		} else if (tags[i] == OPT_ADDR) {
+			len = addr_of(words, i, &a);
+			a = MOVED(a);
+			if (len == 2) {
+				words[i] = vm16_ori(VM16_LUI, RD(w), a >> 6);
+				words[i + 1] = vm16_orri(OP(words[i + 1]), RD(w), RD(w), a & 0x3F);
+			} else {
+				words[i] = vm16_orri(OP(w), RD(w), 0, a);
+			}
+			i += len - 1;
+		}
+	}
+	for (i = 0; i < n; ++i) {
+		if (!keep[i]) {
+			continue;
+		}
+		words[map[i]] = words[i];
+		/* A shortened li is one ADDI */
+		tags[map[i]] = tags[i] == OPT_LI_HI && !keep[i + 1] ? OPT_LI : tags[i];
+	}
+	for (i = 0; i < st->used; ++i)
+		st->sym[i].value = MOVED(st->sym[i].value);
+#undef MOVED
+
+	free(lead);
+	free(keep);
+	free(map);
+	return n - gone;
+}
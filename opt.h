@@ -0,0 +1,44 @@
+/* See LICENSE file for copyright and license details */
+#ifndef OPT_H__
+#define OPT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "symtab.h"
+
+/* What the assembler emitted each word for */
+enum {
+	OPT_CODE,    /* An instruction, nop or halt */
+	OPT_DATA,    /* A .word */
+	OPT_LI_HI,   /* The LUI of a two word li */
+	OPT_LI,      /* The ADDI of an li */
+	OPT_ADDR,    /* A word of la, load or store */
+};
+
+/* Words removed by the optimizer, counted in the image, not as run */
+struct opt_stats {
+	size_t words;  /* All words removed */
+	size_t nops;   /* nops dropped */
+	size_t luis;   /* LUIs of values already in their register */
+	size_t lis;    /* li turned into one ADDI from a known register */
+	size_t folds;  /* ADDIs folded into the one before */
+};
+
+/*
+ * Optimize n words assembled for VM16_ADDR_START, tagged with what they
+ * were emitted for. Known register values are tracked within basic
+ * blocks, which start at labels, branch targets, addresses taken by la,
+ * load and store, and after jalr and data. Branch offsets, addresses of
+ * la, load and store, and the labels in st are moved along with the words
+ * they point to. Addresses computed with li or .word are not, so code
+ * that jumps through them must not be optimized. The word a call skips on
+ * return is kept as it is, and programs using AUIPC are left as they are.
+ * Tags move along with their words. Returns the number of words left and
+ * adds to s.
+ */
+size_t
+opt_run(uint16_t *words, uint8_t *tags, size_t n, struct symtab *st,
+        struct opt_stats *s);
+
+#endif
@@ -0,0 +1,98 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "vm16.h"
+
+bool
+pool_init(struct pool *p, uint16_t *words, size_t nwords)
+{
+	struct vm16 *v = malloc(sizeof(*v));
+
+	if (!v) {
+		return false;
+	}
+	vm16_init(v);
+	if (!vm16_load(v, words, nwords)) {
+		vm16_fini(v);
+		free(v);
+		return false;
+	}
+	vm16_snapshot(v, &p->base);
+	/* The loading machine is the first one handed out */
+	p->free = malloc(sizeof(*p->free));
+	if (!p->free) {
+		vm16_snap_free(&p->base);
+		vm16_fini(v);
+		free(v);
+		return false;
+	}
+	p->free[0] = v;
+	p->nfree = 1;
+	p->cap = 1;
+	pthread_mutex_init(&p->lock, NULL);
+	return true;
+}
+
+struct vm16 *
+pool_get(struct pool *p)
+{
+	struct vm16 *v = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->nfree) {
+		v = p->free[--p->nfree];
+	}
+	pthread_mutex_unlock(&p->lock);
+	if (v) {
+		return v;
+	}
+	v = malloc(sizeof(*v));
+	if (!v) {
+		return NULL;
+	}
+	vm16_init(v);
+	vm16_restore(v, &p->base);
+	return v;
+}
+
+void
+pool_put(struct pool *p, struct vm16 *v)
+{
+	struct vm16 **tmp;
+
+	/* Reset outside of the lock, it is the expensive part */
+	vm16_reset_to(v, &p->base);
+	vm16_devices(v->io);
+	pthread_mutex_lock(&p->lock);
+	if (p->nfree == p->cap) {
+		tmp = realloc(p->free, sizeof(*p->free) * p->cap * 2);
+		if (!tmp) {
+			pthread_mutex_unlock(&p->lock);
+			vm16_fini(v);
+			free(v);
+			return;
+		}
+		p->free = tmp;
+		p->cap *= 2;
+	}
+	p->free[p->nfree++] = v;
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+pool_fini(struct pool *p)
+{
+	size_t i;
+
+	for (i = 0; i < p->nfree; ++i) {
+		vm16_fini(p->free[i]);
+		free(p->free[i]);
+	}
+	free(p->free);
+	vm16_snap_free(&p->base);
+	pthread_mutex_destroy(&p->lock);
+}
@@ -0,0 +1,44 @@
+/* See LICENSE file for copyright and license details */
+#ifndef POOL_H__
+#define POOL_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm16.h"
+
+/*
+ * Machines with an image loaded, shared between threads. Machines handed
+ * back are reset to the freshly loaded image, which only restores the
+ * pages the last run wrote and keeps their execution caches warm.
+ */
+struct pool {
+	pthread_mutex_t lock;
+	struct vm16_snap base; /* The image freshly loaded */
+	struct vm16 **free;    /* Machines ready to be handed out */
+	size_t nfree;
+	size_t cap;
+};
+
+/* Load an image into a pool, returns false when out of memory */
+bool
+pool_init(struct pool *p, uint16_t *words, size_t nwords);
+
+/*
+ * Hand out a machine about to run the image with the default devices,
+ * or NULL when out of memory
+ */
+struct vm16 *
+pool_get(struct pool *p);
+
+/* Give a machine handed out by pool_get back for reuse */
+void
+pool_put(struct pool *p, struct vm16 *v);
+
+/* Release every machine of the pool, all of them must have been put back */
+void
+pool_fini(struct pool *p);
+
+#endif
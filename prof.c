@@ -0,0 +1,97 @@
+/* See LICENSE file for copyright and license details */
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "prof.h"
+#include "vm16.h"
+
+/* FNV-1a over the words, low byte first */
+uint64_t
+prof_hash(uint16_t const *words, size_t nwords)
+{
+	uint64_t h = 14695981039346656037u;
+	size_t i;
+
+	for (i = 0; i < nwords; ++i) {
+		h = (h ^ (words[i] & 0xFF)) * 1099511628211u;
+		h = (h ^ words[i] >> 8) * 1099511628211u;
+	}
+	return h;
+}
+
+bool
+prof_write(FILE *out, uint64_t const *count, uint16_t const *words,
+           size_t nwords)
+{
+	size_t i;
+
+	fprintf(out, "vm16 profile %d\n", PROF_VERSION);
+	fprintf(out, "%zu %016" PRIx64 "\n", nwords, prof_hash(words, nwords));
+	for (i = VM16_ADDR_START; i < VM16_ADDR_START + nwords; ++i) {
+		if (count[i]) {
+			fprintf(out, "0x%04zx %" PRIu64 "\n", i, count[i]);
+		}
+	}
+	return !ferror(out);
+}
+
+bool
+prof_read(struct prof *p, char const *path)
+{
+	FILE *fp = fopen(path, "r");
+	unsigned long addr;
+	uint64_t n;
+	int version;
+
+	memset(p, 0, sizeof(*p));
+	if (!fp) {
+		log_error("Unable to open '%s'\n", path);
+		return false;
+	}
+	if (fscanf(fp, "vm16 profile %d %zu %" SCNx64, &version, &p->nwords,
+	           &p->hash) != 3 || version != PROF_VERSION ||
+	    p->nwords > VM16_MM_SIZE - VM16_ADDR_START) {
+		log_error("'%s' is not a profile\n", path);
+		fclose(fp);
+		return false;
+	}
+	p->count = calloc(p->nwords + 1, sizeof(*p->count));
+	if (!p->count) {
+		log_fatal("Out of memory\n");
+	}
+	p->id = (14695981039346656037u ^ p->hash) * 1099511628211u;
+	while (fscanf(fp, "%lx %" SCNu64, &addr, &n) == 2) {
+		if (addr < VM16_ADDR_START || addr >= VM16_ADDR_START + p->nwords) {
+			break;
+		}
+		p->count[addr - VM16_ADDR_START] = n;
+		p->id = (p->id ^ addr) * 1099511628211u;
+		p->id = (p->id ^ n) * 1099511628211u;
+	}
+	if (!feof(fp)) {
+		log_error("'%s' has a bad count\n", path);
+		prof_free(p);
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+bool
+prof_match(struct prof const *p, uint16_t const *words, size_t nwords)
+{
+	return p->nwords == nwords && p->hash == prof_hash(words, nwords);
+}
+
+void
+prof_free(struct prof *p)
+{
+	free(p->count);
+	p->count = NULL;
+}
@@ -0,0 +1,51 @@
+/* See LICENSE file for copyright and license details */
+#ifndef PROF_H__
+#define PROF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROF_VERSION 1
+
+/*
+ * Execution profiles are text. The first line is "vm16 profile" and
+ * PROF_VERSION, the second the number of words of the program and a hash
+ * of them in hex. Every other line is an address in hex and how many
+ * times the instruction at it was executed, addresses never executed are
+ * left out.
+ */
+
+/* How many times each word of a program was executed */
+struct prof {
+	size_t nwords;
+	uint64_t hash;     /* Of the words the counts were taken of */
+	uint64_t id;       /* Of the whole profile */
+	uint64_t *count;   /* Per word from VM16_ADDR_START, nwords of them */
+};
+
+/* Hash the words of a program, profiles only apply to the same words */
+uint64_t
+prof_hash(uint16_t const *words, size_t nwords);
+
+/*
+ * Write the counts per address of a run, see vm16.prof, of the program
+ * loaded from nwords words
+ */
+bool
+prof_write(FILE *out, uint64_t const *count, uint16_t const *words,
+           size_t nwords);
+
+/* Read the profile at path, logs why it cannot */
+bool
+prof_read(struct prof *p, char const *path);
+
+/* Tell whether a profile was taken of these words */
+bool
+prof_match(struct prof const *p, uint16_t const *words, size_t nwords);
+
+void
+prof_free(struct prof *p);
+
+#endif
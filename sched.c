@@ -0,0 +1,181 @@
+/* See LICENSE file for copyright and license details */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sched.h"
+#include "vm16.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Append a context to the run queue, the lock is held */
+static void
+push(struct sched *s, struct sched_ctx *c)
+{
+	c->next = NULL;
+	if (s->tail) {
+		s->tail->next = c;
+	} else {
+		s->head = c;
+	}
+	s->tail = c;
+	pthread_cond_signal(&s->ready);
+}
+
+/* Run one slice of a context, the lock is not held */
+static void
+slice(struct sched *s, struct sched_ctx *c)
+{
+	uint64_t budget = s->slice, before = c->v->steps;
+	double start = now();
+
+	/* Charge no more than is left of the quota */
+	if (c->quota && c->quota - c->used < budget) {
+		budget = c->quota - c->used;
+	}
+	c->status = s->run(c->v, budget);
+	c->used += c->v->steps - before;
+	c->slices += 1;
+	c->ms += now() - start;
+}
+
+static bool
+finished(struct sched_ctx const *c)
+{
+	switch (c->status) {
+	case VM16_HALTED:
+	case VM16_FAULT:
+		return true;
+	case VM16_BUDGET:
+		return c->quota && c->used >= c->quota;
+	}
+	return false;
+}
+
+static void *
+work(void *arg)
+{
+	struct timespec nap = {0, 1000000};
+	struct sched *s = arg;
+	struct sched_ctx *c;
+	bool idle;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!s->head && !s->stop)
+			pthread_cond_wait(&s->ready, &s->lock);
+		if (s->stop) {
+			break;
+		}
+		c = s->head;
+		s->head = c->next;
+		if (!s->head) {
+			s->tail = NULL;
+		}
+		/* Back off instead of spinning when every context is blocked */
+		idle = c->status == VM16_BLOCKED && s->blocked == s->live;
+		if (c->status == VM16_BLOCKED) {
+			s->blocked -= 1;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		if (idle) {
+			nanosleep(&nap, NULL);
+		}
+		slice(s, c);
+
+		pthread_mutex_lock(&s->lock);
+		if (finished(c)) {
+			s->live -= 1;
+			if (!s->live) {
+				pthread_cond_broadcast(&s->done);
+			}
+			continue;
+		}
+		if (c->status == VM16_BLOCKED) {
+			s->blocked += 1;
+		}
+		push(s, c);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+bool
+sched_init(struct sched *s, size_t nthreads, uint64_t slice,
+           int (*run)(struct vm16 *, uint64_t))
+{
+	s->head = NULL;
+	s->tail = NULL;
+	s->live = 0;
+	s->blocked = 0;
+	s->stop = false;
+	s->slice = slice ? slice : 1;
+	s->run = run;
+	s->nthreads = 0;
+	s->tids = calloc(nthreads ? nthreads : 1, sizeof(*s->tids));
+	if (!s->tids) {
+		return false;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->ready, NULL);
+	pthread_cond_init(&s->done, NULL);
+	for (; s->nthreads < nthreads; ++s->nthreads) {
+		if (pthread_create(&s->tids[s->nthreads], NULL, work, s))
+			break;
+	}
+	if (!s->nthreads) {
+		sched_fini(s);
+		return false;
+	}
+	return true;
+}
+
+void
+sched_add(struct sched *s, struct sched_ctx *c)
+{
+	c->used = 0;
+	c->slices = 0;
+	c->ms = 0;
+	c->status = VM16_RUNNING;
+	pthread_mutex_lock(&s->lock);
+	s->live += 1;
+	push(s, c);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+sched_wait(struct sched *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->live)
+		pthread_cond_wait(&s->done, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void
+sched_fini(struct sched *s)
+{
+	size_t i;
+
+	pthread_mutex_lock(&s->lock);
+	s->stop = true;
+	pthread_cond_broadcast(&s->ready);
+	pthread_mutex_unlock(&s->lock);
+	for (i = 0; i < s->nthreads; ++i)
+		pthread_join(s->tids[i], NULL);
+	pthread_cond_destroy(&s->done);
+	pthread_cond_destroy(&s->ready);
+	pthread_mutex_destroy(&s->lock);
+	free(s->tids);
+	s->tids = NULL;
+}
@@ -0,0 +1,61 @@
+/* See LICENSE file for copyright and license details */
+#ifndef SCHED_H__
+#define SCHED_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm16.h"
+
+/* A machine time-sliced by a scheduler */
+struct sched_ctx {
+	struct vm16 *v;         /* Machine to run */
+	uint64_t quota;         /* Instructions it may execute, 0 for no limit */
+	uint64_t used;          /* Instructions executed under the scheduler */
+	uint64_t slices;        /* Slices run */
+	double ms;              /* Wall time spent in slices */
+	int status;             /* Outcome of the last slice */
+	struct sched_ctx *next; /* Next context of the run queue */
+};
+
+/*
+ * Round-robin scheduler running contexts on a pool of threads, one slice
+ * of at most slice instructions at a time. Contexts leave once halted,
+ * faulted or out of quota. Blocked contexts go to the back of the queue
+ * and are retried.
+ */
+struct sched {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;        /* The run queue is not empty */
+	pthread_cond_t done;         /* No context is left */
+	struct sched_ctx *head;      /* Run queue */
+	struct sched_ctx *tail;
+	size_t live;                 /* Contexts added and not finished */
+	size_t blocked;              /* Live contexts whose last slice blocked */
+	bool stop;                   /* Workers are to exit */
+	uint64_t slice;              /* Instructions per slice */
+	int (*run)(struct vm16 *, uint64_t);
+	pthread_t *tids;
+	size_t nthreads;
+};
+
+/* Start nthreads workers running slices with run, such as vm16_run */
+bool
+sched_init(struct sched *s, size_t nthreads, uint64_t slice,
+           int (*run)(struct vm16 *, uint64_t));
+
+/* Queue a context, clearing its accounting */
+void
+sched_add(struct sched *s, struct sched_ctx *c);
+
+/* Wait until every context added has finished */
+void
+sched_wait(struct sched *s);
+
+/* Stop the workers, contexts still queued are left alone */
+void
+sched_fini(struct sched *s);
+
+#endif
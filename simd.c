@@ -0,0 +1,314 @@
+/* See LICENSE file for copyright and license details */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "simd.h"
+#include "vm16.h"
+
+/*
+ * Every kernel below is a loop over all VM16X_LANES words of local arrays,
+ * which compilers turn into a handful of vector instructions.
+ */
+typedef uint16_t lanes[VM16X_LANES];
+
+/* Copy src into dst for the lanes set in m */
+static void
+blend(uint16_t *dst, lanes const src, lanes const m)
+{
+	size_t l;
+
+	for (l = 0; l < VM16X_LANES; ++l)
+		dst[l] = (src[l] & m[l]) | (dst[l] & ~m[l]);
+}
+
+/* Write a result to guest register rd of the lanes set in m */
+static void
+put(struct vm16x *x, uint16_t rd, lanes const res, lanes const m, bool full)
+{
+	if (!rd) {
+		return;
+	}
+	if (full) {
+		memcpy(x->r[rd], res, sizeof(lanes));
+	} else {
+		blend(x->r[rd], res, m);
+	}
+}
+
+static void
+fill(lanes dst, uint16_t w)
+{
+	size_t l;
+
+	for (l = 0; l < VM16X_LANES; ++l)
+		dst[l] = w;
+}
+
+/* Execute a MATH instruction for every lane */
+static void
+math(lanes res, lanes const a, lanes const b, uint16_t alt)
+{
+	size_t l;
+
+	switch (alt) {
+	case VM16_ADD:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = a[l] + b[l];
+		break;
+	case VM16_SUB:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = a[l] - b[l];
+		break;
+	case VM16_SLL:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = (unsigned)a[l] << (b[l] & 31);
+		break;
+	case VM16_SRL:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = a[l] >> (b[l] & 31);
+		break;
+	case VM16_NAND:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = ~(a[l] & b[l]);
+		break;
+	case VM16_AND:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = a[l] & b[l];
+		break;
+	case VM16_OR:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = a[l] | b[l];
+		break;
+	case VM16_LT:
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = a[l] < b[l];
+		break;
+	}
+}
+
+/* Act on the outcome of a device access by lane l */
+static void
+park(struct vm16x *x, size_t l, int io, lanes npc, uint16_t next)
+{
+	switch (io) {
+	case VM16_IO_HALT:
+		npc[l] = VM16_ADDR_HALT;
+		break;
+	case VM16_IO_BLOCK:
+	case VM16_IO_FAULT:
+		/* Stop the context in front of the access */
+		npc[l] = VM16_ADDR(next - 1);
+		x->steps[l] -= 1;
+		x->status[l] = io == VM16_IO_BLOCK ? VM16_BLOCKED : VM16_FAULT;
+		break;
+	}
+}
+
+/*
+ * Execute ir for the lanes set in m, full when that is every lane. Returns
+ * true after control transfers and memory accesses, with the address each
+ * lane continues at in npc.
+ */
+static bool
+step(struct vm16x *x, lanes const m, bool full, uint16_t ir, uint16_t next,
+     lanes npc)
+{
+	uint16_t op, rd, im10, r1, im7, alt, r2, a;
+	lanes ra, rb, res;
+	struct vm16_dev *d;
+	size_t l;
+	int io;
+
+	op   = (ir & 0x0007) >> 0;
+	rd   = (ir & 0x0038) >> 3;
+	im10 = (ir & 0xFFC0) >> 6;
+	r1   = (ir & 0x01C0) >> 6;
+	im7  = (ir & 0xFE00) >> 9;
+	alt  = (ir & 0x1E00) >> 9;
+	r2   = (ir & 0xE000) >> 13;
+	im7 |= im7 & 0x40 ? 0xFF80 : 0x0000;
+
+	switch (op) {
+	case VM16_LUI:
+		fill(res, im10 << 6);
+		put(x, rd, res, m, full);
+		return false;
+	case VM16_AUIPC:
+		fill(res, next + (im10 << 6));
+		put(x, rd, res, m, full);
+		return false;
+	case VM16_JALR:
+		fill(res, next + 1);
+		put(x, rd, res, m, full);
+		/* The link is written before the target is read */
+		memcpy(ra, x->r[r1], sizeof(ra));
+		for (l = 0; l < VM16X_LANES; ++l)
+			npc[l] = VM16_ADDR(ra[l] + im7);
+		return true;
+	case VM16_BEQ:
+		memcpy(ra, x->r[rd], sizeof(ra));
+		memcpy(rb, x->r[r1], sizeof(rb));
+		for (l = 0; l < VM16X_LANES; ++l)
+			npc[l] = VM16_ADDR(next + (ra[l] == rb[l] ? im7 : 0));
+		return true;
+	case VM16_LW:
+		/* Memory accesses gather from a different word in every lane */
+		fill(npc, next);
+		for (l = 0; l < VM16X_LANES; ++l) {
+			if (!m[l]) {
+				continue;
+			}
+			a = VM16_ADDR(x->r[r1][l] + im7);
+			d = a < VM16_IO_SIZE ? &x->io[l][a] : NULL;
+			if (!d || !d->read) {
+				x->r[rd][l] = x->mm[a][l];
+				continue;
+			}
+			io = d->read(d->ctx, NULL, a, &x->r[rd][l]);
+			park(x, l, io, npc, next);
+		}
+		/* Hardwire register zero to the value 0 */
+		memset(x->r[0], 0, sizeof(x->r[0]));
+		return true;
+	case VM16_SW:
+		fill(npc, next);
+		for (l = 0; l < VM16X_LANES; ++l) {
+			if (!m[l]) {
+				continue;
+			}
+			a = VM16_ADDR(x->r[r1][l] + im7);
+			d = a < VM16_IO_SIZE ? &x->io[l][a] : NULL;
+			if (!d || !d->write) {
+				x->mm[a][l] = x->r[rd][l];
+			} else {
+				io = d->write(d->ctx, NULL, a, x->r[rd][l]);
+				park(x, l, io, npc, next);
+			}
+		}
+		return true;
+	case VM16_ADDI:
+		memcpy(ra, x->r[r1], sizeof(ra));
+		for (l = 0; l < VM16X_LANES; ++l)
+			res[l] = ra[l] + im7;
+		put(x, rd, res, m, full);
+		return false;
+	case VM16_MATH:
+		if (alt > VM16_LT) {
+			return false;
+		}
+		memcpy(ra, x->r[r1], sizeof(ra));
+		memcpy(rb, x->r[r2], sizeof(rb));
+		math(res, ra, rb, alt);
+		put(x, rd, res, m, full);
+		return false;
+	}
+	return false;
+}
+
+bool
+vm16x_init(struct vm16x *x, size_t n)
+{
+	size_t l;
+
+	if (n > VM16X_LANES) {
+		return false;
+	}
+	memset(x, 0, sizeof(*x));
+	x->n = n;
+	/* Unused contexts start out halted */
+	for (l = 0; l < n; ++l) {
+		x->pc[l] = VM16_ADDR_START;
+		vm16_devices(x->io[l]);
+	}
+	return true;
+}
+
+bool
+vm16x_load(struct vm16x *x, uint16_t const *words, uint16_t nwords)
+{
+	uint16_t i;
+
+	if (VM16_ADDR_START + nwords >= VM16_MM_SIZE) {
+		return false;
+	}
+	for (i = 0; i < nwords; ++i)
+		fill(x->mm[VM16_ADDR_START + i], words[i]);
+	return true;
+}
+
+void
+vm16x_run(struct vm16x *x, uint64_t max)
+{
+	lanes m, npc, last;
+	uint16_t pc, ir, all, diff;
+	int16_t key, k;
+	uint64_t n, left;
+	size_t l, first;
+
+	for (;;) {
+		/*
+		 * Step the contexts at the lowest address first, which lets
+		 * contexts that took different paths through a loop meet again.
+		 * Halted contexts wrap around to the highest key, stopped ones
+		 * are given it.
+		 */
+		key = 0x7FFF;
+		for (l = 0; l < VM16X_LANES; ++l) {
+			k = (x->pc[l] - 1) & 0x7FFF;
+			k |= -(int16_t)(x->status[l] != VM16_RUNNING) & 0x7FFF;
+			key = k < key ? k : key;
+		}
+		if (key == 0x7FFF) {
+			break;
+		}
+		pc = key + 1;
+		for (first = 0; x->pc[first] != pc || x->status[first]; ++first)
+			;
+		/* Contexts that rewrote the word wait for a later round */
+		ir = x->mm[pc][first];
+		all = 0xFFFF;
+		for (l = 0; l < VM16X_LANES; ++l) {
+			m[l] = -(uint16_t)((x->pc[l] == pc) & (x->mm[pc][l] == ir) &
+			                   (x->status[l] == VM16_RUNNING));
+			all &= m[l];
+		}
+		/* The group stops with the context closest to its budget */
+		left = UINT64_MAX;
+		for (l = 0; l < VM16X_LANES; ++l) {
+			if (max && m[l] && max - x->steps[l] < left)
+				left = max - x->steps[l];
+		}
+		/*
+		 * The group runs straight-line code together, the program counter
+		 * and instruction register are only written back once it ends.
+		 */
+		for (n = 1;; ++n) {
+			if (step(x, m, all, ir, VM16_ADDR(pc + 1), npc)) {
+				break;
+			}
+			pc = VM16_ADDR(pc + 1);
+			fill(npc, pc);
+			if (pc == VM16_ADDR_HALT || n == left) {
+				break;
+			}
+			diff = 0;
+			for (l = 0; l < VM16X_LANES; ++l)
+				diff |= m[l] & (x->mm[pc][l] ^ x->mm[pc][first]);
+			if (diff) {
+				break;
+			}
+			ir = x->mm[pc][first];
+		}
+		fill(last, ir);
+		blend(x->ir, last, m);
+		blend(x->pc, npc, m);
+		for (l = 0; l < VM16X_LANES; ++l) {
+			x->steps[l] += n & -(uint64_t)(m[l] & 1);
+			if (max && m[l] && x->steps[l] >= max &&
+			    x->status[l] == VM16_RUNNING)
+				x->status[l] = VM16_BUDGET;
+		}
+	}
+}
@@ -0,0 +1,51 @@
+/* See LICENSE file for copyright and license details */
+#ifndef SIMD_H__
+#define SIMD_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm16.h"
+
+/* Contexts of a lockstep machine, 16 words fill a 256-bit vector */
+#define VM16X_LANES 16
+
+/*
+ * VM16X_LANES machine contexts stored side by side, so that the same
+ * register or memory word of every context is contiguous. Contexts whose
+ * program counters agree are stepped together, the others wait their turn.
+ */
+struct vm16x {
+	size_t n;                                     /* Contexts in use */
+	uint16_t ir[VM16X_LANES];                     /* Instruction registers */
+	uint16_t pc[VM16X_LANES];                     /* Program counters */
+	uint16_t r[8][VM16X_LANES];                   /* General purpose registers */
+	uint64_t steps[VM16X_LANES];                  /* Instructions executed */
+	uint8_t status[VM16X_LANES];                  /* Why a context stopped */
+	struct vm16_dev io[VM16X_LANES][VM16_IO_SIZE]; /* Device windows */
+	uint16_t mm[VM16_MM_SIZE][VM16X_LANES];       /* Main memories */
+};
+
+/*
+ * Reset n contexts as vm16_init would. Device handlers of the contexts are
+ * called with a NULL machine.
+ */
+bool
+vm16x_init(struct vm16x *x, size_t n);
+
+/* Load the same program into every context */
+bool
+vm16x_load(struct vm16x *x, uint16_t const *words, uint16_t nwords);
+
+/*
+ * Execute until the program counter of every context equals 0, or the
+ * context was stopped by a blocking or faulting device access or after
+ * max instructions, 0 for no limit. Such contexts keep their status,
+ * VM16_BLOCKED, VM16_FAULT or VM16_BUDGET, until it is reset to
+ * VM16_RUNNING.
+ */
+void
+vm16x_run(struct vm16x *x, uint64_t max);
+
+#endif
@@ -0,0 +1,132 @@
+/* See LICENSE file for copyright and license details */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sink.h"
+#include "vm16.h"
+
+void
+sink_init_fd(struct sink *s, int fd)
+{
+	memset(s, 0, offsetof(struct sink, buf));
+	s->fd = fd;
+}
+
+void
+sink_init_mem(struct sink *s)
+{
+	sink_init_fd(s, -1);
+}
+
+void
+sink_fini(struct sink *s)
+{
+	sink_flush(s);
+	free(s->mem);
+	s->mem = NULL;
+	s->memlen = 0;
+	s->memcap = 0;
+}
+
+/* Append the buffer to the memory block, doubling it as needed */
+static bool
+collect(struct sink *s)
+{
+	size_t cap = s->memcap ? s->memcap : SINK_SIZE;
+	char *mem;
+
+	while (cap - s->memlen < s->len)
+		cap *= 2;
+	if (cap != s->memcap) {
+		mem = realloc(s->mem, cap);
+		if (!mem) {
+			return false;
+		}
+		s->mem = mem;
+		s->memcap = cap;
+	}
+	memcpy(s->mem + s->memlen, s->buf, s->len);
+	s->memlen += s->len;
+	return true;
+}
+
+bool
+sink_flush(struct sink *s)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	if (s->fd < 0) {
+		s->error |= !collect(s);
+		off = s->len;
+	}
+	while (off < s->len) {
+		n = write(s->fd, s->buf + off, s->len - off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			s->error = true;
+			break;
+		}
+		off += n;
+	}
+	/* Bytes that could not be written are dropped, not retried */
+	s->flushed += off;
+	s->len = 0;
+	return !s->error;
+}
+
+void
+sink_putc(struct sink *s, char c)
+{
+	if (s->len == SINK_SIZE) {
+		sink_flush(s);
+	}
+	s->buf[s->len++] = c;
+	s->count += 1;
+}
+
+/* Buffer anything but zero written to VM16_ADDR_OUT */
+static int
+out_write(void *ctx, struct vm16 *v, uint16_t addr, uint16_t w)
+{
+	(void)v;
+	(void)addr;
+	if (w != 0) {
+		sink_putc(ctx, w);
+	}
+	return VM16_IO_OK;
+}
+
+/* Any store to VM16_ADDR_FLUSH flushes */
+static int
+flush_write(void *ctx, struct vm16 *v, uint16_t addr, uint16_t w)
+{
+	(void)v;
+	(void)addr;
+	(void)w;
+	sink_flush(ctx);
+	return VM16_IO_OK;
+}
+
+void
+sink_attach(struct sink *s, struct vm16 *v)
+{
+	sink_map(s, v->io);
+}
+
+void
+sink_map(struct sink *s, struct vm16_dev io[VM16_IO_SIZE])
+{
+	struct vm16_dev out = {NULL, out_write, NULL};
+	struct vm16_dev flush = {NULL, flush_write, NULL};
+
+	out.ctx = s;
+	flush.ctx = s;
+	io[VM16_ADDR_OUT] = out;
+	io[VM16_ADDR_FLUSH] = flush;
+}
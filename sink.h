@@ -0,0 +1,58 @@
+/* See LICENSE file for copyright and license details */
+#ifndef SINK_H__
+#define SINK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm16.h"
+
+/* Bytes buffered by a sink before it flushes */
+#define SINK_SIZE (64 << 10)
+
+/*
+ * Buffered target for bytes written to VM16_ADDR_OUT. Output reaches a file
+ * descriptor or a memory block in bulk, on a full buffer, a store to
+ * VM16_ADDR_FLUSH or an explicit sink_flush.
+ */
+struct sink {
+	int fd;             /* Target descriptor, or -1 to collect in memory */
+	bool error;         /* A write to the target failed */
+	size_t count;       /* Bytes written by the guest */
+	size_t flushed;     /* Bytes handed to the target */
+	char *mem;          /* Collected output of a memory sink */
+	size_t memlen;      /* Bytes in mem */
+	size_t memcap;      /* Capacity of mem */
+	size_t len;         /* Bytes in buf */
+	char buf[SINK_SIZE];
+};
+
+/* Send output to a file descriptor, STDOUT_FILENO for stdout */
+void
+sink_init_fd(struct sink *s, int fd);
+
+/* Collect output in memory, readable from mem once flushed */
+void
+sink_init_mem(struct sink *s);
+
+/* Flush, then release the memory of a memory sink */
+void
+sink_fini(struct sink *s);
+
+/* Hand everything buffered to the target, false on write errors */
+bool
+sink_flush(struct sink *s);
+
+/* Buffer one byte */
+void
+sink_putc(struct sink *s, char c);
+
+/* Map the sink behind VM16_ADDR_OUT and VM16_ADDR_FLUSH of a machine */
+void
+sink_attach(struct sink *s, struct vm16 *v);
+
+/* Map the sink into a device window */
+void
+sink_map(struct sink *s, struct vm16_dev io[VM16_IO_SIZE]);
+
+#endif
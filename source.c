@@ -0,0 +1,102 @@
+/* See LICENSE file for copyright and license details */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "source.h"
+#include "vm16.h"
+
+void
+source_init_fd(struct source *s, int fd)
+{
+	memset(s, 0, offsetof(struct source, buf));
+	s->fd = fd;
+	s->pos = s->buf;
+	s->end = s->buf;
+}
+
+void
+source_init_file(struct source *s, FILE *fp)
+{
+	source_init_fd(s, -1);
+	s->fp = fp;
+}
+
+void
+source_init_mem(struct source *s, void const *mem, size_t len)
+{
+	source_init_fd(s, -1);
+	s->pos = mem;
+	s->end = s->pos + len;
+}
+
+/*
+ * Read ahead from the origin. Returns 1 once bytes are available, 0 at the
+ * end of the input and -1 when a non-blocking descriptor has nothing yet.
+ */
+static int
+refill(struct source *s)
+{
+	ssize_t n = 0;
+
+	if (s->fp) {
+		n = fread(s->buf, 1, SOURCE_SIZE, s->fp);
+		s->error |= ferror(s->fp) != 0;
+	} else if (s->fd >= 0) {
+		do {
+			n = read(s->fd, s->buf, SOURCE_SIZE);
+		} while (n < 0 && errno == EINTR);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return -1;
+		}
+		if (n < 0) {
+			s->error = true;
+			n = 0;
+		}
+	}
+	s->pos = s->buf;
+	s->end = s->buf + n;
+	return n > 0;
+}
+
+int
+source_getc(struct source *s, uint16_t *w)
+{
+	if (s->pos == s->end) {
+		switch (refill(s)) {
+		case -1:
+			return VM16_IO_BLOCK;
+		case 0:
+			*w = VM16_IN_EOF;
+			return VM16_IO_OK;
+		}
+	}
+	s->count += 1;
+	*w = *s->pos++;
+	return VM16_IO_OK;
+}
+
+static int
+in_read(void *ctx, struct vm16 *v, uint16_t addr, uint16_t *w)
+{
+	(void)v;
+	(void)addr;
+	return source_getc(ctx, w);
+}
+
+void
+source_attach(struct source *s, struct vm16 *v)
+{
+	source_map(s, v->io);
+}
+
+void
+source_map(struct source *s, struct vm16_dev io[VM16_IO_SIZE])
+{
+	struct vm16_dev in = {in_read, NULL, NULL};
+
+	in.ctx = s;
+	io[VM16_ADDR_IN] = in;
+}
@@ -0,0 +1,56 @@
+/* See LICENSE file for copyright and license details */
+#ifndef SOURCE_H__
+#define SOURCE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "vm16.h"
+
+/* Bytes read ahead by a source */
+#define SOURCE_SIZE (64 << 10)
+
+/*
+ * Buffered origin of the bytes loaded from VM16_ADDR_IN. Descriptors and
+ * files are read SOURCE_SIZE bytes at a time, memory blocks are read in
+ * place. Loads block the machine while a non-blocking descriptor is empty.
+ */
+struct source {
+	int fd;                     /* Origin descriptor, or -1 */
+	FILE *fp;                   /* Origin file, or NULL */
+	bool error;                 /* A read from the origin failed */
+	size_t count;               /* Bytes read by the guest */
+	unsigned char const *pos;   /* Next unread byte */
+	unsigned char const *end;   /* End of the unread bytes */
+	unsigned char buf[SOURCE_SIZE];
+};
+
+/* Read from a file descriptor, STDIN_FILENO for stdin */
+void
+source_init_fd(struct source *s, int fd);
+
+/* Read from an open file */
+void
+source_init_file(struct source *s, FILE *fp);
+
+/* Read from a memory block that outlives the source */
+void
+source_init_mem(struct source *s, void const *mem, size_t len);
+
+/*
+ * Read the next byte, or VM16_IN_EOF once the origin is exhausted, into w.
+ * Returns VM16_IO_BLOCK when a non-blocking descriptor has nothing yet.
+ */
+int
+source_getc(struct source *s, uint16_t *w);
+
+/* Map the source behind VM16_ADDR_IN of a machine */
+void
+source_attach(struct source *s, struct vm16 *v);
+
+/* Map the source into a device window */
+void
+source_map(struct source *s, struct vm16_dev io[VM16_IO_SIZE]);
+
+#endif
@@ -8,12 +8,12 @@
 #include "zone.h"
 #include "symtab.h"
 
-static size_t
+static uint32_t
 hash(void const *k, size_t klen)
 {
 	size_t i;
-	size_t const p = 16777619;
-	size_t hash = 2166136261u;
+	uint32_t const p = 16777619;
+	uint32_t hash = 2166136261u;
 
 	for (i = 0; i < klen; ++i)
 		hash = (hash ^ ((uint8_t *)k)[i]) * p;
@@ -22,27 +22,94 @@ hash(void const *k, size_t klen)
 	hash += hash << 3;
 	hash ^= hash >> 17;
 	hash += hash << 5;
-	return hash;
+	return hash ? hash : 1;
+}
+
+/* How far slot i holding hash h is from where its probe starts */
+static size_t
+dist(size_t size, size_t i, uint32_t h)
+{
+	return (i - h) & (size - 1);
 }
 
+/* Find the label named by k, returns st->used when there is none */
 static size_t
 find_index(struct symtab const *st, struct token const *k)
 {
-	size_t i;
-	size_t begin;
-	
-	begin = hash(k->bytes, k->len) % st->size;
-	i = begin;
-	while (st->k[i]) {
-		if (st->k[i]->len == k->len && !memcmp(st->k[i]->bytes, k->bytes, k->len)) {
-			break;
+	uint32_t h = hash(k->bytes, k->len);
+	size_t i = h & (st->size - 1), d;
+	struct sym const *s;
+
+	/* Robin Hood keeps runs ordered by distance, so misses stop early */
+	for (d = 0; st->slot[i].hash &&
+	            dist(st->size, i, st->slot[i].hash) >= d; ++d) {
+		s = &st->sym[st->slot[i].sym];
+		if (st->slot[i].hash == h && s->len == k->len &&
+		    !memcmp(s->name, k->bytes, k->len)) {
+			return st->slot[i].sym;
 		}
-		i = (i + 1) % st->size;
-		if (begin == i) {
-			return st->size;
+		i = (i + 1) & (st->size - 1);
+	}
+	return st->used;
+}
+
+/* Put a label into the index, taking slots from labels closer to home */
+static void
+place(struct symslot *slot, size_t size, struct symslot e)
+{
+	size_t i = e.hash & (size - 1), d, ed = 0;
+	struct symslot tmp;
+
+	for (;; i = (i + 1) & (size - 1), ++ed) {
+		if (!slot[i].hash) {
+			slot[i] = e;
+			return;
+		}
+		d = dist(size, i, slot[i].hash);
+		if (d < ed) {
+			tmp = slot[i];
+			slot[i] = e;
+			e = tmp;
+			ed = d;
 		}
 	}
-	return i;
+}
+
+/* Double the index and the labels it can hold */
+static bool
+grow(struct symtab *st)
+{
+	struct symslot *slot;
+	struct sym *sym;
+	size_t i;
+
+	slot = calloc(st->size * 2, sizeof(*slot));
+	if (!slot) {
+		return false;
+	}
+	for (i = 0; i < st->size; ++i) {
+		if (st->slot[i].hash)
+			place(slot, st->size * 2, st->slot[i]);
+	}
+	free(st->slot);
+	st->slot = slot;
+	st->size *= 2;
+	sym = realloc(st->sym, sizeof(*sym) * st->cap * 2);
+	if (!sym) {
+		return false;
+	}
+	st->sym = sym;
+	st->cap *= 2;
+	return true;
+}
+
+/* Copy the bytes of a label right after those of the labels before it */
+static char const *
+intern(struct symtab *st, char const *bytes, size_t len)
+{
+	char *name = zone_alignedz(st->z, len, 1);
+
+	return name ? memcpy(name, bytes, len) : NULL;
 }
 
 struct symtab *
@@ -50,54 +117,72 @@ symtab_create(size_t size)
 {
 	struct zone *z;
 	struct symtab *st;
-		
-	z = zone_pushz(NULL);
 
+	z = zone_pushz(NULL);
+	if (!z) {
+		return NULL;
+	}
 	st = zone_allocz(z, sizeof(*st));
 	if (!st) {
+		zone_popz(z);
 		return NULL;
 	}
 	st->z = z;
-	st->k = zone_allocz(z, sizeof(*st->k) * size);
-	st->v = zone_allocz(z, sizeof(*st->v) * size);
-	st->size = size;
+	/* Slots stay at most 7/8 full */
+	for (st->size = 16; st->size / 8 * 7 < size; st->size *= 2)
+		;
+	st->cap = st->size / 8 * 7;
 	st->used = 0;
+	st->sym = malloc(sizeof(*st->sym) * st->cap);
+	st->slot = calloc(st->size, sizeof(*st->slot));
+	if (!st->sym || !st->slot) {
+		symtab_destroy(st);
+		return NULL;
+	}
 	return st;
 }
 
 void
 symtab_destroy(struct symtab *s)
 {
+	free(s->sym);
+	free(s->slot);
 	zone_popz(s->z);
 }
 
-struct token const *
-symtab_getk(struct symtab const *st, struct token const *k)
+size_t
+symtab_find(struct symtab const *st, struct token const *k)
 {
-	size_t i = find_index(st, k);
-
-	if (i >= st->size || !st->k[i]) {
-		return NULL;
-	}
-	return st->k[i];
+	return find_index(st, k);
 }
 
 uint16_t *
 symtab_getv(struct symtab *st, struct token const *k)
 {
 	size_t i = find_index(st, k);
+	struct symslot e;
+	struct sym *s;
+	char const *name;
 
-	if (i >= st->size) {
+	if (i < st->used) {
+		return &st->sym[i].value;
+	}
+	if (st->used == st->cap && !grow(st)) {
 		return NULL;
 	}
-	if (!st->k[i]) {
-		st->k[i] = zone_allocz(st->z, sizeof(*k));
-		if (!st->k[i])
-			return NULL;
-		memcpy(st->k[i], k, sizeof(*k));
-		st->used += 1;
+	name = intern(st, k->bytes, k->len);
+	if (!name) {
+		return NULL;
 	}
-	return &st->v[i];
+	s = &st->sym[st->used];
+	s->name = name;
+	s->len = k->len;
+	s->value = 0;
+	s->off = 0;
+	e.hash = hash(k->bytes, k->len);
+	e.sym = st->used++;
+	place(st->slot, st->size, e);
+	return &s->value;
 }
 
 uint16_t *
@@ -105,8 +190,8 @@ symtab_at(struct symtab const *st, struct token const *k)
 {
 	size_t i = find_index(st, k);
 
-	if (i >= st->size || !st->k[i]) {
+	if (i == st->used) {
 		return NULL;
 	}
-	return &st->v[i];
+	return &st->sym[i].value;
 }
@@ -2,25 +2,56 @@
 #ifndef SYMTAB_H__
 #define SYMTAB_H__
 
+#include <stdint.h>
+
 #include "lex.h"
 
+/* A label and its value */
+struct sym {
+	char const *name;  /* Interned bytes of the label */
+	uint32_t len;      /* Bytes of the name */
+	uint16_t value;
+	size_t off;        /* Where the assembler found the label defined */
+};
+
+/* Slot of the index, 0 hash for empty ones */
+struct symslot {
+	uint32_t hash;
+	uint32_t sym;      /* Index into sym */
+};
+
+/*
+ * Labels in order of definition, found through a Robin Hood hash index
+ * that doubles once it is 7/8 full.
+ */
 struct symtab {
-	struct zone *z;
-	struct token **k;
-	uint16_t *v;
-	size_t size;
+	struct zone *z;          /* Interned names */
+	struct sym *sym;
 	size_t used;
+	size_t cap;
+	struct symslot *slot;
+	size_t size;             /* Slots, a power of two */
 };
 
+/* Create a table with room for about size labels */
 struct symtab *
 symtab_create(size_t size);
 
-struct token const *
-symtab_getk(struct symtab const *st, struct token const *k);
+void
+symtab_destroy(struct symtab *st);
+
+/* Index of a label in sym, st->used when there is none */
+size_t
+symtab_find(struct symtab const *st, struct token const *k);
 
+/*
+ * Find or add a label. Returns a pointer to its value, valid until the
+ * next label is added, or NULL when out of memory.
+ */
 uint16_t *
 symtab_getv(struct symtab *st, struct token const *k);
 
+/* Value of a label, NULL when there is none */
 uint16_t *
 symtab_at(struct symtab const *st, struct token const *k);
 
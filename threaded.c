@@ -0,0 +1,226 @@
+/* See LICENSE file for copyright and license details */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icache.h"
+#include "threaded.h"
+#include "vm16.h"
+
+/*
+ * With GNU C every handler jumps straight to the handler of the next
+ * instruction through a table of label addresses. Other compilers get the
+ * same handlers inside a switch.
+ */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define HANDLER(x) op_##x:
+#define NEXT() do { \
+	if (steps >= limit) { \
+		goto out; \
+	} \
+	in = &insn[pc]; \
+	pc = VM16_ADDR(pc + 1); \
+	steps += 1; \
+	goto *tbl[in->op]; \
+} while (0)
+#define BEGIN() NEXT();
+#define END()
+#else
+#define HANDLER(x) case IC_##x:
+#define NEXT() continue
+#define BEGIN() for (;;) { \
+	if (steps >= limit) { \
+		goto out; \
+	} \
+	in = &insn[pc]; \
+	pc = VM16_ADDR(pc + 1); \
+	steps += 1; \
+	switch (in->op) {
+#define END() }}
+#endif
+
+/* Memory accesses, only the device window traps into the device bus */
+#define LOAD(a, rd) do { \
+	if ((a) >= VM16_IO_SIZE) { \
+		r[rd] = VM16_PEEK(v, a); \
+	} else if ((io = vm16_io_read(v, (a), &r[rd])) != VM16_IO_OK) { \
+		goto device; \
+	} \
+	r[0] = 0; \
+} while (0)
+#define STORE(a, w) do { \
+	if ((a) >= VM16_IO_SIZE) { \
+		if (!vm16_poke(v, (a), (w))) { \
+			io = VM16_IO_FAULT; \
+			goto device; \
+		} \
+		icache_inval(v->ic, (a)); \
+	} else if ((io = vm16_io_write(v, (a), (w))) != VM16_IO_OK) { \
+		goto device; \
+	} \
+} while (0)
+
+void
+vm16_exec_threaded(struct vm16 *v)
+{
+	vm16_run_threaded(v, UINT64_MAX);
+}
+
+int
+vm16_run_threaded(struct vm16 *v, uint64_t max)
+{
+#ifdef __GNUC__
+	static void const *tbl[IC_COUNT] = {
+		&&op_LUI, &&op_AUIPC, &&op_JALR, &&op_BEQ,
+		&&op_LW, &&op_SW, &&op_ADDI,
+		&&op_ADD, &&op_SUB, &&op_SLL, &&op_SRL,
+		&&op_NAND, &&op_AND, &&op_OR, &&op_LT,
+		&&op_NOP, &&op_JMP,
+		&&op_LI, &&op_LOAD, &&op_STORE, &&op_NOPS,
+		&&op_DECODE,
+	};
+#endif
+	struct vm16_insn *insn, *in, *last = NULL;
+	uint16_t r[8], pc, a;
+	uint64_t steps, limit, end = vm16_run_begin(v, max);
+	int io;
+
+	if (v->pc == VM16_ADDR_HALT) {
+		return VM16_HALTED;
+	}
+	if (!icache_attach(v)) {
+		return vm16_run(v, max);
+	}
+	/* Superinstructions may overshoot, so stop short of the budget */
+	limit = end > IC_SPAN_MAX ? end - IC_SPAN_MAX : 0;
+	/* Machine state lives in locals until the program halts */
+	insn = v->ic->insn;
+	memcpy(r, v->r, sizeof(r));
+	pc = v->pc;
+	steps = v->steps;
+
+	BEGIN()
+	HANDLER(LUI)
+		r[in->rd] = in->im;
+		NEXT();
+	HANDLER(AUIPC)
+		r[in->rd] = pc + in->im;
+		NEXT();
+	HANDLER(JALR)
+		last = in;
+		if (in->rd) {
+			r[in->rd] = pc + 1;
+		}
+		pc = VM16_ADDR(r[in->r1] + in->im);
+		NEXT();
+	HANDLER(BEQ)
+		last = in;
+		pc = VM16_ADDR(pc + (r[in->rd] == r[in->r1] ? in->im : 0));
+		NEXT();
+	HANDLER(JMP)
+		last = in;
+		pc = VM16_ADDR(pc + in->im);
+		NEXT();
+	HANDLER(LW)
+		a = VM16_ADDR(r[in->r1] + in->im);
+		LOAD(a, in->rd);
+		NEXT();
+	HANDLER(SW)
+		a = VM16_ADDR(r[in->r1] + in->im);
+		STORE(a, r[in->rd]);
+		NEXT();
+	HANDLER(ADDI)
+		r[in->rd] = r[in->r1] + in->im;
+		NEXT();
+	HANDLER(ADD)
+		r[in->rd] = r[in->r1] + r[in->r2];
+		NEXT();
+	HANDLER(SUB)
+		r[in->rd] = r[in->r1] - r[in->r2];
+		NEXT();
+	HANDLER(SLL)
+		r[in->rd] = r[in->r1] << r[in->r2];
+		NEXT();
+	HANDLER(SRL)
+		r[in->rd] = r[in->r1] >> r[in->r2];
+		NEXT();
+	HANDLER(NAND)
+		r[in->rd] = ~(r[in->r1] & r[in->r2]);
+		NEXT();
+	HANDLER(AND)
+		r[in->rd] = r[in->r1] & r[in->r2];
+		NEXT();
+	HANDLER(OR)
+		r[in->rd] = r[in->r1] | r[in->r2];
+		NEXT();
+	HANDLER(LT)
+		r[in->rd] = r[in->r1] < r[in->r2];
+		NEXT();
+	HANDLER(NOP)
+		NEXT();
+	HANDLER(LI)
+		r[in->rd] = in->im;
+		pc = VM16_ADDR(pc + 1);
+		steps += 1;
+		NEXT();
+	HANDLER(LOAD)
+		/* A retried load reads the address the LUI left in the register */
+		r[in->rd] = in->ir & 0xFFC0;
+		pc = VM16_ADDR(pc + 1);
+		steps += 1;
+		LOAD(VM16_ADDR(in->im), in->rd);
+		NEXT();
+	HANDLER(STORE)
+		/* The stored value is what the LUI left in the register */
+		r[in->rd] = in->ir & 0xFFC0;
+		pc = VM16_ADDR(pc + 1);
+		steps += 1;
+		STORE(VM16_ADDR(in->im), r[in->rd]);
+		NEXT();
+	HANDLER(NOPS)
+		pc = VM16_ADDR(pc + in->im - 1);
+		steps += in->im - 1;
+		NEXT();
+	HANDLER(DECODE)
+		/* The halt address is never decoded, so reaching it ends up here */
+		a = in - insn;
+		steps -= 1;
+		if (a == VM16_ADDR_HALT) {
+			goto halt;
+		}
+		icache_fill(v->ic, v, a);
+#ifdef __GNUC__
+		steps += 1;
+		goto *tbl[in->op];
+#else
+		pc = a;
+		NEXT();
+#endif
+	END()
+
+device:
+	if (io == VM16_IO_HALT) {
+		goto halt;
+	}
+	/* Undo the access so that resuming retries it */
+	pc = VM16_ADDR(pc - 1);
+	steps -= 1;
+	v->status = io == VM16_IO_BLOCK ? VM16_BLOCKED : VM16_FAULT;
+	goto out;
+halt:
+	pc = VM16_ADDR_HALT;
+out:
+	memcpy(v->r, r, sizeof(r));
+	v->steps = steps;
+	v->pc = pc;
+	/* The instruction register holds the last branch taken */
+	if (last) {
+		v->ir = last->ir;
+	}
+	/* Use up what is left of the budget one instruction at a time */
+	while (v->pc != VM16_ADDR_HALT && v->status == VM16_RUNNING && v->steps < end)
+		vm16_step_cached(v);
+	return vm16_status(v);
+}
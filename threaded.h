@@ -0,0 +1,18 @@
+/* See LICENSE file for copyright and license details */
+#ifndef THREADED_H__
+#define THREADED_H__
+
+#include "vm16.h"
+
+/*
+ * Execute until the program counter equals 0, dispatching pre-decoded
+ * instructions directly from one handler to the next
+ */
+void
+vm16_exec_threaded(struct vm16 *v);
+
+/* Execute at most max instructions with threaded dispatch, see vm16_run */
+int
+vm16_run_threaded(struct vm16 *v, uint64_t max);
+
+#endif
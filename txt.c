@@ -1,14 +1,125 @@
 /* See LICENSE txt for copyright and license details */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "txt.h"
 
 void
 txt_init(struct txt *t, char const *name, char const *str)
 {
 	t->name = name;
-	t->row = 1;
-	t->col = 1;
 	t->seek = 0;
 	t->str = str;
+	t->len = strlen(str);
+	t->span = 0;
+	t->lines = NULL;
+	t->nlines = 0;
+}
+
+/*
+ * Map len bytes of a file followed by at least one zero byte. The part of
+ * the last file page past the end reads as zeros, and a page of anonymous
+ * memory follows when the file fills its last page.
+ */
+static char *
+map(int fd, size_t len, size_t *span)
+{
+	size_t pg = sysconf(_SC_PAGESIZE);
+	char *p;
+
+	*span = (len / pg + 1) * pg;
+	p = mmap(NULL, *span, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	if (len && MAP_FAILED ==
+	    mmap(p, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)) {
+		munmap(p, *span);
+		return NULL;
+	}
+	return p;
+}
+
+/* Read a pipe or terminal to its end, doubling the buffer as it fills */
+static char *
+stream(int fd, size_t *len)
+{
+	size_t cap = 1 << 16, n = 0;
+	char *buf = malloc(cap), *tmp;
+	ssize_t r;
+
+	while (buf) {
+		if (n + 1 == cap) {
+			cap *= 2;
+			tmp = realloc(buf, cap);
+			if (!tmp) {
+				break;
+			}
+			buf = tmp;
+		}
+		r = read(fd, buf + n, cap - n - 1);
+		if (r > 0) {
+			n += r;
+		} else if (!r) {
+			buf[n] = '\0';
+			*len = n;
+			return buf;
+		} else if (errno != EINTR) {
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+bool
+txt_open(struct txt *t, char const *path)
+{
+	struct stat st;
+	char *str = NULL;
+	size_t len = 0, span = 0;
+	int fd;
+
+	fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		return false;
+	}
+	if (!fstat(fd, &st)) {
+		if (S_ISREG(st.st_mode)) {
+			len = st.st_size;
+			str = map(fd, len, &span);
+		} else {
+			str = stream(fd, &len);
+		}
+	}
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	if (!str) {
+		return false;
+	}
+	txt_init(t, path, "");
+	t->str = str;
+	t->len = len;
+	t->span = span;
+	return true;
+}
+
+void
+txt_close(struct txt *t)
+{
+	if (t->span) {
+		munmap((void *)t->str, t->span);
+	} else {
+		free((void *)t->str);
+	}
+	free(t->lines);
+	t->str = NULL;
 }
 
 char const *
@@ -20,23 +131,74 @@ txt_at(struct txt *t)
 char
 txt_get(struct txt *t)
 {
-	int ch;
-
 	if ('\0' == t->str[t->seek]) {
 		return '\0';
 	}
-	ch = t->str[t->seek++];
-	if ('\n' == ch) {
-		t->row += 1;
-		t->col = 1;
-	} else {
-		t->col += 1;
+	return t->str[t->seek++];
+}
+
+void
+txt_seek(struct txt *t, char const *at)
+{
+	t->seek = at - t->str;
+}
+
+/* Record where every line starts */
+static bool
+index_lines(struct txt *t)
+{
+	char const *p;
+	size_t n = 1;
+
+	for (p = t->str; (p = strchr(p, '\n')); ++p)
+		n += 1;
+	t->lines = malloc(sizeof(*t->lines) * n);
+	if (!t->lines) {
+		return false;
 	}
-	return ch;
+	t->lines[0] = 0;
+	t->nlines = 1;
+	for (p = t->str; (p = strchr(p, '\n')); ++p)
+		t->lines[t->nlines++] = p + 1 - t->str;
+	return true;
+}
+
+void
+txt_pos(struct txt *t, char const *at, size_t *row, size_t *col)
+{
+	size_t off = at - t->str, lo = 0, hi;
+
+	if (!t->lines && !index_lines(t)) {
+		/* Count the lines up to at without an index */
+		char const *p, *line = t->str;
+
+		*row = 1;
+		for (p = t->str; p < at; ++p) {
+			if (*p == '\n') {
+				*row += 1;
+				line = p + 1;
+			}
+		}
+		*col = at - line + 1;
+		return;
+	}
+	/* Last line starting at or before off */
+	hi = t->nlines;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (t->lines[mid] <= off) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	*row = lo + 1;
+	*col = off - t->lines[lo] + 1;
 }
 
 void
 txt_reset(struct txt *t)
 {
-	txt_init(t, t->name, t->str);
+	t->seek = 0;
 }
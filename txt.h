@@ -1,26 +1,53 @@
 #ifndef TXT_H__
 #define TXT_H__
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 struct txt {
 	char const *name; /* Name of the txt document */
-	size_t row;       /* Current row of the cursor */
-	size_t col;       /* Current column of the cursor */
 	size_t seek;      /* Cursor into the data */
 	char const *str;  /* The backing string data */
+	size_t len;       /* Bytes of data before the terminator */
+	size_t span;      /* Bytes mapped by txt_open, 0 when read into memory */
+	size_t *lines;    /* Offsets of line starts, built on first txt_pos */
+	size_t nlines;
 };
 
 void
 txt_init(struct txt *t, char const *name, char const *str);
 
+/*
+ * Open the file at path, or stdin for "-". Regular files are mapped and
+ * lexed in place, anything else is read into a growing buffer. Returns
+ * false when the file cannot be read.
+ */
+bool
+txt_open(struct txt *t, char const *path);
+
+/* Release the data of a txt opened with txt_open */
+void
+txt_close(struct txt *t);
+
 char
 txt_get(struct txt *t);
 
 char const *
 txt_at(struct txt *t);
 
+/* Move the cursor to at, which points into the data */
+void
+txt_seek(struct txt *t, char const *at);
+
+/*
+ * Find the row and column of at, which points into the data. Positions
+ * are only needed for diagnostics, so the line index is built on the first
+ * call.
+ */
+void
+txt_pos(struct txt *t, char const *at, size_t *row, size_t *col);
+
 void
 txt_reset(struct txt *t);
 
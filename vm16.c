@@ -1,12 +1,118 @@
 /* See LICENSE file for copyright and license details */
+#include <pthread.h>
 #include <string.h>
 
+#include "icache.h"
+#include "jit.h"
 #include "vm16.h"
 
 #define M3(x) ((x) & 0x7)
 #define M7(x) ((x) & 0x7F)
 #define MA(x) ((x) & 0x3FF)
 
+/* Memory of a reset machine, never written and never released */
+static struct vm16_page zero;
+static struct vm16_mem empty;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* Identifies the next snapshot taken */
+static uint64_t snaps = 1;
+
+static void
+fill(void)
+{
+	size_t i;
+
+	for (i = 0; i < VM16_PAGES; ++i)
+		empty.pg[i] = &zero;
+}
+
+static void
+ref(struct vm16_page *p)
+{
+	if (p != &zero) {
+		__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+unref(struct vm16_page *p)
+{
+	if (p != &zero && !__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(p);
+	}
+}
+
+static void
+ref_mem(struct vm16_mem *m)
+{
+	if (m != &empty) {
+		__atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+unref_mem(struct vm16_mem *m)
+{
+	size_t i;
+
+	if (m == &empty || __atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	for (i = 0; i < VM16_PAGES; ++i)
+		unref(m->pg[i]);
+	free(m);
+}
+
+/* Drop code decoded from page i */
+static void
+inval(struct vm16 *v, size_t i)
+{
+	uint16_t a;
+
+	for (a = i * VM16_PAGE_SIZE; a < (i + 1) * VM16_PAGE_SIZE; ++a) {
+		if (v->ic)
+			icache_inval(v->ic, a);
+		if (v->jit)
+			jit_inval(v->jit, a);
+	}
+}
+
+/* Share a page table, dropping code decoded from pages that differ */
+static void
+adopt(struct vm16 *v, struct vm16_mem *m)
+{
+	size_t i;
+
+	ref_mem(m);
+	for (i = 0; i < VM16_PAGES; ++i) {
+		if (v->mm->pg[i] != m->pg[i])
+			inval(v, i);
+	}
+	unref_mem(v->mm);
+	v->mm = m;
+	memset(v->own, 0, sizeof(v->own));
+}
+
+/* Mark memory as in sync with a snapshot */
+static void
+clean(struct vm16 *v, struct vm16_snap const *s)
+{
+	v->base = s->id;
+	memset(v->dirty, 0, sizeof(v->dirty));
+}
+
+/* Restore the registers of a snapshot */
+static void
+regs(struct vm16 *v, struct vm16_snap const *s)
+{
+	v->ir = s->ir;
+	v->pc = s->pc;
+	memcpy(v->r, s->r, sizeof(v->r));
+	v->steps = s->steps;
+	v->status = VM16_RUNNING;
+}
+
 void
 vm16_dump(FILE *out, struct vm16 const *v)
 {
@@ -15,36 +121,311 @@ vm16_dump(FILE *out, struct vm16 const *v)
 	fprintf(out, "r:  [0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x, 0x%x]\n",
 			v->r[0], v->r[1], v->r[2], v->r[3],
 			v->r[4], v->r[5], v->r[6], v->r[7]);
-	fprintf(out, "mm[pc-2]: 0x%x\n", v->mm[v->pc-2]);
-	fprintf(out, "mm[pc-1]: 0x%x\n", v->mm[v->pc-1]);
-	fprintf(out, "mm[pc]:   0x%x\n", v->mm[v->pc]);
-	fprintf(out, "mm[pc+1]: 0x%x\n", v->mm[v->pc+1]);
-	fprintf(out, "mm[pc+2]: 0x%x\n", v->mm[v->pc+2]);
+	fprintf(out, "mm[pc-2]: 0x%x\n", VM16_PEEK(v, VM16_ADDR(v->pc-2)));
+	fprintf(out, "mm[pc-1]: 0x%x\n", VM16_PEEK(v, VM16_ADDR(v->pc-1)));
+	fprintf(out, "mm[pc]:   0x%x\n", VM16_PEEK(v, VM16_ADDR(v->pc)));
+	fprintf(out, "mm[pc+1]: 0x%x\n", VM16_PEEK(v, VM16_ADDR(v->pc+1)));
+	fprintf(out, "mm[pc+2]: 0x%x\n", VM16_PEEK(v, VM16_ADDR(v->pc+2)));
 	fprintf(out, "\n");
 }
 
 void
 vm16_exec(struct vm16 *v)
 {
-	while (v->pc != VM16_ADDR_HALT)
+	vm16_run(v, UINT64_MAX);
+}
+
+uint64_t
+vm16_run_begin(struct vm16 *v, uint64_t max)
+{
+	v->status = VM16_RUNNING;
+	return max > UINT64_MAX - v->steps ? UINT64_MAX : v->steps + max;
+}
+
+int
+vm16_status(struct vm16 const *v)
+{
+	if (v->status != VM16_RUNNING) {
+		return v->status;
+	}
+	return v->pc == VM16_ADDR_HALT ? VM16_HALTED : VM16_BUDGET;
+}
+
+int
+vm16_run(struct vm16 *v, uint64_t max)
+{
+	uint64_t end = vm16_run_begin(v, max);
+
+	while (v->pc != VM16_ADDR_HALT && v->steps < end && v->status == VM16_RUNNING)
 		vm16_step(v);
+	return vm16_status(v);
+}
+
+/* Storing to the halt address stops the machine */
+static int
+halt_write(void *ctx, struct vm16 *v, uint16_t addr, uint16_t w)
+{
+	(void)ctx;
+	(void)v;
+	(void)addr;
+	(void)w;
+	return VM16_IO_HALT;
+}
+
+/* Output anything but zero written to memory-mapped stdout */
+static int
+out_write(void *ctx, struct vm16 *v, uint16_t addr, uint16_t w)
+{
+	(void)v;
+	(void)addr;
+	if (w != 0) {
+		putc(w, ctx);
+	}
+	return VM16_IO_OK;
+}
+
+/* Read a byte of memory-mapped stdin */
+static int
+in_read(void *ctx, struct vm16 *v, uint16_t addr, uint16_t *w)
+{
+	int c = getc(ctx);
+
+	(void)v;
+	(void)addr;
+	*w = c == EOF ? VM16_IN_EOF : c;
+	return VM16_IO_OK;
+}
+
+/* Flush memory-mapped stdout on any store */
+static int
+flush_write(void *ctx, struct vm16 *v, uint16_t addr, uint16_t w)
+{
+	(void)v;
+	(void)addr;
+	(void)w;
+	fflush(ctx);
+	return VM16_IO_OK;
+}
+
+void
+vm16_devices(struct vm16_dev io[VM16_IO_SIZE])
+{
+	struct vm16_dev none = {NULL, NULL, NULL};
+	struct vm16_dev halt = {NULL, halt_write, NULL};
+	struct vm16_dev out = {NULL, out_write, NULL};
+	struct vm16_dev flush = {NULL, flush_write, NULL};
+	struct vm16_dev in = {in_read, NULL, NULL};
+	uint16_t a;
+
+	out.ctx = stdout;
+	flush.ctx = stdout;
+	in.ctx = stdin;
+	for (a = 0; a < VM16_IO_SIZE; ++a)
+		io[a] = none;
+	io[VM16_ADDR_HALT] = halt;
+	io[VM16_ADDR_OUT] = out;
+	io[VM16_ADDR_FLUSH] = flush;
+	io[VM16_ADDR_IN] = in;
 }
 
 void
 vm16_init(struct vm16 *v)
 {
+	pthread_once(&once, fill);
 	memset(v, 0, sizeof(*v));
 	v->pc = 0x10;
+	v->mm = &empty;
+	vm16_devices(v->io);
+}
+
+bool
+vm16_map(struct vm16 *v, uint16_t lo, uint16_t hi, struct vm16_dev const *dev)
+{
+	uint16_t a;
+
+	if (lo > hi || hi >= VM16_IO_SIZE) {
+		return false;
+	}
+	for (a = lo; a <= hi; ++a)
+		v->io[a] = *dev;
+	return true;
+}
+
+int
+vm16_io_read(struct vm16 *v, uint16_t addr, uint16_t *w)
+{
+	struct vm16_dev *d = &v->io[addr];
+
+	if (d->read) {
+		return d->read(d->ctx, v, addr, w);
+	}
+	*w = VM16_PEEK(v, addr);
+	return VM16_IO_OK;
+}
+
+int
+vm16_io_write(struct vm16 *v, uint16_t addr, uint16_t w)
+{
+	struct vm16_dev *d = &v->io[addr];
+
+	if (d->write) {
+		return d->write(d->ctx, v, addr, w);
+	}
+	/* Unmapped words are plain memory, which may even hold code */
+	if (!vm16_poke(v, addr, w)) {
+		return VM16_IO_FAULT;
+	}
+	if (v->ic) {
+		icache_inval(v->ic, addr);
+	}
+	if (v->jit) {
+		jit_inval(v->jit, addr);
+	}
+	return VM16_IO_OK;
+}
+
+void
+vm16_fini(struct vm16 *v)
+{
+	icache_detach(v);
+	jit_detach(v);
+	unref_mem(v->mm);
+	v->mm = &empty;
+	memset(v->own, 0, sizeof(v->own));
+	v->base = 0;
+}
+
+struct vm16_page *
+vm16_own(struct vm16 *v, uint16_t addr)
+{
+	size_t i = addr >> VM16_PAGE_BITS, k;
+	struct vm16_mem *m = v->mm;
+	struct vm16_page *p;
+
+	/* Nobody else can take a new reference to what only we refer to */
+	if (m == &empty || __atomic_load_n(&m->refs, __ATOMIC_ACQUIRE) != 1) {
+		m = malloc(sizeof(*m));
+		if (!m) {
+			return NULL;
+		}
+		m->refs = 1;
+		for (k = 0; k < VM16_PAGES; ++k) {
+			m->pg[k] = v->mm->pg[k];
+			ref(m->pg[k]);
+		}
+		unref_mem(v->mm);
+		v->mm = m;
+	}
+	p = m->pg[i];
+	if (p == &zero || __atomic_load_n(&p->refs, __ATOMIC_ACQUIRE) != 1) {
+		p = malloc(sizeof(*p));
+		if (!p) {
+			return NULL;
+		}
+		p->refs = 1;
+		memcpy(p->w, m->pg[i]->w, sizeof(p->w));
+		unref(m->pg[i]);
+		m->pg[i] = p;
+		/* Only pages copied here can differ from the last snapshot */
+		v->dirty[i / 64] |= (uint64_t)1 << i % 64;
+	}
+	v->own[i] = 1;
+	return p;
+}
+
+void
+vm16_snapshot(struct vm16 *v, struct vm16_snap *s)
+{
+	s->ir = v->ir;
+	s->pc = v->pc;
+	memcpy(s->r, v->r, sizeof(s->r));
+	s->steps = v->steps;
+	s->id = __atomic_fetch_add(&snaps, 1, __ATOMIC_RELAXED);
+	ref_mem(v->mm);
+	s->mm = v->mm;
+	memset(v->own, 0, sizeof(v->own));
+	clean(v, s);
+}
+
+void
+vm16_restore(struct vm16 *v, struct vm16_snap const *s)
+{
+	regs(v, s);
+	adopt(v, s->mm);
+	clean(v, s);
+}
+
+void
+vm16_reset_to(struct vm16 *v, struct vm16_snap const *s)
+{
+	struct vm16_mem *m = v->mm;
+	size_t i;
+
+	/* Swap back the pages written in place unless the table is shared */
+	if (v->base != s->id || m == &empty ||
+	    __atomic_load_n(&m->refs, __ATOMIC_ACQUIRE) != 1) {
+		vm16_restore(v, s);
+		return;
+	}
+	regs(v, s);
+	for (i = 0; i < VM16_PAGES; ++i) {
+		if (!v->dirty[i / 64]) {
+			i += 63;
+			continue;
+		}
+		if (!(v->dirty[i / 64] & (uint64_t)1 << i % 64)) {
+			continue;
+		}
+		ref(s->mm->pg[i]);
+		unref(m->pg[i]);
+		m->pg[i] = s->mm->pg[i];
+		v->own[i] = 0;
+		inval(v, i);
+	}
+	clean(v, s);
+}
+
+void
+vm16_snap_free(struct vm16_snap *s)
+{
+	unref_mem(s->mm);
+	s->mm = &empty;
+}
+
+void
+vm16_fork(struct vm16 *child, struct vm16 *parent)
+{
+	memcpy(child, parent, sizeof(*child));
+	child->ic = NULL;
+	child->jit = NULL;
+	ref_mem(parent->mm);
+	memset(parent->own, 0, sizeof(parent->own));
+	memset(child->own, 0, sizeof(child->own));
 }
 
 bool
 vm16_load(struct vm16 *vm, uint16_t *words, uint16_t nwords)
 {
+	return vm16_load_at(vm, VM16_ADDR_START, words, nwords);
+}
+
+bool
+vm16_load_at(struct vm16 *vm, uint16_t addr, uint16_t const *words, size_t nwords)
+{
+	size_t i;
+
 	/* Don't load the words if they can't fit in main memory */
-	if (0x10 + nwords >= VM16_MM_SIZE) {
+	if (addr + nwords >= VM16_MM_SIZE) {
 		return false;
 	}
-	memcpy(&vm->mm[VM16_ADDR_START], words, sizeof (*words) * nwords);
+	for (i = 0; i < nwords; ++i) {
+		if (!vm16_poke(vm, addr + i, words[i]))
+			return false;
+		if (vm->ic)
+			icache_inval(vm->ic, addr + i);
+		if (vm->jit)
+			jit_inval(vm->jit, addr + i);
+	}
 	return true;
 }
 
@@ -69,13 +450,19 @@ vm16_orrar(uint8_t op, uint8_t rd, uint8_t r1, uint8_t alt, uint8_t r2)
 void
 vm16_step(struct vm16 *v)
 {
-	uint16_t op, rd, im10, r1, im7, alt, r2;
+	uint16_t op, rd, im10, r1, im7, alt, r2, a;
+	int io = VM16_IO_OK;
 	
 	if (v->pc == VM16_ADDR_HALT) {
 		return;
 	}
+	v->steps += 1;
+	if (v->prof) {
+		v->prof[v->pc] += 1;
+	}
 	/* Fetch */
-	v->ir = v->mm[v->pc++];
+	v->ir = VM16_PEEK(v, v->pc);
+	v->pc++;
 	/* Decode */
 	op   = (v->ir & 0x0007) >> 0;
 	rd   = (v->ir & 0x0038) >> 3;
@@ -104,10 +491,30 @@ vm16_step(struct vm16 *v)
 		v->pc += v->r[rd] == v->r[r1] ? im7 : 0;
 		break;
 	case VM16_LW:
-		v->r[rd] = v->mm[v->r[r1] + im7];
+		a = VM16_ADDR(v->r[r1] + im7);
+		if (a < VM16_IO_SIZE) {
+			io = vm16_io_read(v, a, &v->r[rd]);
+		} else {
+			v->r[rd] = VM16_PEEK(v, a);
+		}
 		break;
 	case VM16_SW:
-		v->mm[v->r[r1] + im7] = v->r[rd];
+		a = VM16_ADDR(v->r[r1] + im7);
+		if (a < VM16_IO_SIZE) {
+			io = vm16_io_write(v, a, v->r[rd]);
+			break;
+		}
+		if (!vm16_poke(v, a, v->r[rd])) {
+			io = VM16_IO_FAULT;
+			break;
+		}
+		/* Keep pre-decoded and translated copies of the word coherent */
+		if (v->ic) {
+			icache_inval(v->ic, a);
+		}
+		if (v->jit) {
+			jit_inval(v->jit, a);
+		}
 		break;
 	case VM16_ADDI:
 		v->r[rd] = v->r[r1] + im7;
@@ -142,9 +549,19 @@ vm16_step(struct vm16 *v)
 	}
 	/* Hardwire register zero to the value 0 */
 	v->r[0] = 0;
-	/* Output anything written to memory-mapped stdout */
-	if (v->mm[VM16_ADDR_OUT] != 0) {
-		putc(v->mm[VM16_ADDR_OUT], stdout);
-		v->mm[VM16_ADDR_OUT] = 0;
+	switch (io) {
+	case VM16_IO_HALT:
+		v->pc = VM16_ADDR_HALT;
+		break;
+	case VM16_IO_BLOCK:
+	case VM16_IO_FAULT:
+		/* Undo the access so that resuming retries it */
+		v->pc -= 1;
+		v->steps -= 1;
+		if (v->prof) {
+			v->prof[v->pc] -= 1;
+		}
+		v->status = io == VM16_IO_BLOCK ? VM16_BLOCKED : VM16_FAULT;
+		break;
 	}
 }
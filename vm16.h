@@ -31,18 +31,104 @@
 #define VM16_ADDR_HALT  0x0000
 #define VM16_ADDR_OUT   0x0001
 #define VM16_ADDR_IN    0x0002
+#define VM16_ADDR_FLUSH 0x0003
 #define VM16_ADDR_START 0x0010
 
+/* Loaded from VM16_ADDR_IN once input is exhausted */
+#define VM16_IN_EOF 0xFFFF
+
+/* Words below the program start are reserved for memory-mapped devices */
+#define VM16_IO_SIZE VM16_ADDR_START
+
 /* Maximum amount of memory available */
 #define VM16_MM_SIZE (1 << 15)
 
+/* Wrap a computed address into main memory */
+#define VM16_ADDR(x) ((uint16_t)(x) & (VM16_MM_SIZE - 1))
+
+/* Main memory is made of pages, the unit of copy-on-write sharing */
+#define VM16_PAGE_BITS 8
+#define VM16_PAGE_SIZE (1 << VM16_PAGE_BITS)
+#define VM16_PAGES (VM16_MM_SIZE / VM16_PAGE_SIZE)
+
+/* Load a word of main memory */
+#define VM16_PEEK(v, a) \
+	((v)->mm->pg[(a) >> VM16_PAGE_BITS]->w[(a) & (VM16_PAGE_SIZE - 1)])
+
+/* Outcomes of a device access */
+enum {
+	VM16_IO_OK,    /* Continue with the next instruction */
+	VM16_IO_HALT,  /* Stop the machine as if it jumped to VM16_ADDR_HALT */
+	VM16_IO_BLOCK, /* Nothing to transfer yet, retry the access on resume */
+	VM16_IO_FAULT, /* Reject the access and stop the machine in front of it */
+};
+
+/* Outcomes of a bounded run */
+enum {
+	VM16_RUNNING, /* Still running, only seen inside an engine */
+	VM16_HALTED,  /* The program counter reached VM16_ADDR_HALT */
+	VM16_BUDGET,  /* The step budget ran out */
+	VM16_BLOCKED, /* A device had nothing to transfer yet */
+	VM16_FAULT,   /* A device rejected an access */
+};
+
+struct icache;
+struct jit;
+struct vm16;
+
+/*
+ * A memory-mapped device. Handlers return one of the VM16_IO_ outcomes, a
+ * missing handler accesses main memory instead.
+ */
+struct vm16_dev {
+	int (*read)(void *ctx, struct vm16 *v, uint16_t addr, uint16_t *w);
+	int (*write)(void *ctx, struct vm16 *v, uint16_t addr, uint16_t w);
+	void *ctx;
+};
+
+/*
+ * A page of main memory, shared by every page table referring to it.
+ * Shared pages are never written, they are copied first.
+ */
+struct vm16_page {
+	uint32_t refs;
+	uint16_t w[VM16_PAGE_SIZE];
+};
+
+/*
+ * Page table of main memory, shared by every machine and snapshot
+ * referring to it, and copied like pages before it is changed
+ */
+struct vm16_mem {
+	uint32_t refs;
+	struct vm16_page *pg[VM16_PAGES];
+};
+
 struct vm16 {
 	uint16_t ir;               /* Instruction register */
 	uint16_t pc : 15;          /* Program counter */
 	uint16_t r[8];             /* General purpose registers */
-	uint16_t mm[VM16_MM_SIZE]; /* Main memory */
+	struct vm16_mem *mm;       /* Main memory */
+	uint8_t own[VM16_PAGES];   /* The page and its table are ours alone */
+	struct vm16_dev io[VM16_IO_SIZE]; /* Device bus */
+	struct icache *ic;         /* Pre-decoded instructions, or NULL */
+	struct jit *jit;           /* Translated instructions, or NULL */
+	uint64_t steps;            /* Instructions executed */
+	uint64_t *prof;            /* Executions per address, or NULL */
+	int status;                /* VM16_BLOCKED or VM16_FAULT once stopped */
+	uint64_t base;             /* Snapshot memory was last synced with */
+	uint64_t dirty[VM16_PAGES / 64]; /* Pages written since then */
 };
 
+/* Registers and memory of a machine, sharing its page table */
+struct vm16_snap {
+	uint16_t ir;
+	uint16_t pc;
+	uint16_t r[8];
+	uint64_t steps;
+	uint64_t id;         /* Tells snapshots apart, never 0 */
+	struct vm16_mem *mm;
+};
 
 /* Dump a text representation of machine state to file */
 void
@@ -52,12 +138,112 @@ vm16_dump(FILE *out, struct vm16 const *v);
 void
 vm16_exec(struct vm16 *vm);
 
+/*
+ * Execute at most max instructions and return one of VM16_HALTED,
+ * VM16_BUDGET, VM16_BLOCKED or VM16_FAULT. A blocked or faulting access
+ * has no effect and is the next instruction of a resumed run.
+ */
+int
+vm16_run(struct vm16 *v, uint64_t max);
+
+/* Start a run of at most max instructions, returning the final step count */
+uint64_t
+vm16_run_begin(struct vm16 *v, uint64_t max);
+
+/* Return the outcome of the last run */
+int
+vm16_status(struct vm16 const *v);
+
+/*
+ * Reset the machine with stdin behind VM16_ADDR_IN and stdout behind
+ * VM16_ADDR_OUT and VM16_ADDR_FLUSH
+ */
 void
 vm16_init(struct vm16 *v);
 
+/* Fill a device window with the devices of a freshly reset machine */
+void
+vm16_devices(struct vm16_dev io[VM16_IO_SIZE]);
+
+/* Map a device over the words lo through hi of the device window */
+bool
+vm16_map(struct vm16 *v, uint16_t lo, uint16_t hi, struct vm16_dev const *dev);
+
+/* Load a word of the device window, *w is left alone unless it succeeds */
+int
+vm16_io_read(struct vm16 *v, uint16_t addr, uint16_t *w);
+
+/* Store a word to the device window */
+int
+vm16_io_write(struct vm16 *v, uint16_t addr, uint16_t w);
+
+/* Release the memory and any execution state attached to the machine */
+void
+vm16_fini(struct vm16 *v);
+
+/*
+ * Make the page holding addr private to the machine so that it can be
+ * written, copying it when shared. Returns NULL when out of memory.
+ */
+struct vm16_page *
+vm16_own(struct vm16 *v, uint16_t addr);
+
+/* Store a word of main memory, returns false when out of memory */
+static inline bool
+vm16_poke(struct vm16 *v, uint16_t addr, uint16_t w)
+{
+	struct vm16_page *p;
+
+	if (v->own[addr >> VM16_PAGE_BITS]) {
+		p = v->mm->pg[addr >> VM16_PAGE_BITS];
+	} else if (!(p = vm16_own(v, addr))) {
+		return false;
+	}
+	p->w[addr & (VM16_PAGE_SIZE - 1)] = w;
+	return true;
+}
+
+/*
+ * Capture the registers and memory of a machine. Both share memory until
+ * one of them writes to it, so this costs no copying.
+ */
+void
+vm16_snapshot(struct vm16 *v, struct vm16_snap *s);
+
+/*
+ * Return a machine to a snapshot, keeping its devices. The machine shares
+ * the memory of the snapshot, and only code decoded from pages that differ
+ * from it is dropped.
+ */
+void
+vm16_restore(struct vm16 *v, struct vm16_snap const *s);
+
+/*
+ * Return a machine to a snapshot it was taken from or last restored to,
+ * looking only at the pages written since. Falls back on vm16_restore for
+ * other snapshots.
+ */
+void
+vm16_reset_to(struct vm16 *v, struct vm16_snap const *s);
+
+/* Release the pages of a snapshot */
+void
+vm16_snap_free(struct vm16_snap *s);
+
+/*
+ * Initialize child as a copy of parent sharing its memory. The child uses
+ * the same devices and starts without execution caches.
+ */
+void
+vm16_fork(struct vm16 *child, struct vm16 *parent);
+
 bool
 vm16_load(struct vm16 *vm, uint16_t *program, uint16_t n);
 
+/* Load words at addr, returns false unless they fit in main memory */
+bool
+vm16_load_at(struct vm16 *vm, uint16_t addr, uint16_t const *words, size_t n);
+
 /* Synthesize an ori type instruction */
 uint16_t
 vm16_ori(uint8_t op, uint8_t rd, uint16_t im10);
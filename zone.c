@@ -6,8 +6,8 @@
 #include "zone.h"
 
 #define CHUNK_SIZE 4096
-
-struct zone *head;
+/* Chunks a thread keeps for reuse */
+#define SPARE_MAX 64
 
 struct zone {
 	struct zone *next;
@@ -16,10 +16,17 @@ struct zone {
 
 struct chunk {
 	struct chunk *next;
+	size_t size;
 	size_t sp;
 	uint8_t *bytes;
 };
 
+/* Every thread has its own zone stack, spare chunks and counters */
+static __thread struct zone *head;
+static __thread struct chunk *spare;
+static __thread size_t nspare;
+static __thread struct zone_stats stats;
+
 static size_t
 max(size_t a, size_t b) {return a > b ? a : b;}
 
@@ -28,17 +35,43 @@ mkchunk(size_t size, struct chunk *next)
 {
 	struct chunk *rv;
 
-	rv = calloc(1, sizeof(*rv) + size);
-	if (!rv) {
-		return NULL;
+	if (size <= CHUNK_SIZE && spare) {
+		rv = spare;
+		spare = rv->next;
+		nspare -= 1;
+	} else {
+		size = max(size, CHUNK_SIZE);
+		rv = malloc(sizeof(*rv) + size);
+		if (!rv) {
+			return NULL;
+		}
+		rv->bytes = (uint8_t *)(rv + 1);
+		rv->size = size;
+		stats.retained += size;
+		stats.chunks += 1;
+		stats.mallocs += 1;
 	}
-	rv->bytes = (uint8_t *)(rv + 1);
-	rv->sp = size;
+	rv->sp = rv->size;
 	rv->next = next;
 
 	return rv;
 }
 
+/* Keep a chunk for reuse unless there are enough already */
+static void
+rmchunk(struct chunk *c)
+{
+	if (c->size == CHUNK_SIZE && nspare < SPARE_MAX) {
+		c->next = spare;
+		spare = c;
+		nspare += 1;
+		return;
+	}
+	stats.retained -= c->size;
+	stats.chunks -= 1;
+	free(c);
+}
+
 void
 zone_push()
 {
@@ -53,23 +86,50 @@ zone_pop()
 
 void *
 zone_alloc(size_t n)
+{
+	return zone_aligned(n, ZONE_ALIGN);
+}
+
+void *
+zone_aligned(size_t n, size_t align)
+{
+	if (!head) {
+		zone_push();
+	}
+	return zone_alignedz(head, n, align);
+}
+
+zone_pos
+zone_mark()
 {
 	if (!head) {
 		zone_push();
 	}
-	return zone_allocz(head, n);
+	return zone_markz(head);
+}
+
+void
+zone_rewind(zone_pos m)
+{
+	zone_rewindz(head, m);
 }
 
 zone *
 zone_pushz(zone *z)
 {
+	struct chunk *c;
 	struct zone *tmp;
 
-	tmp = malloc(sizeof(*tmp));
+	/* The zone lives at the top of its first chunk */
+	c = mkchunk(CHUNK_SIZE, NULL);
+	if (!c) {
+		return NULL;
+	}
+	c->sp -= sizeof(*tmp);
+	tmp = (struct zone *)&c->bytes[c->sp];
 	tmp->next = z;
-
-	/* The initial zone is empty to avoid allocating unused space */
-	tmp->chunk = mkchunk(0, NULL);
+	tmp->chunk = c;
+	stats.requested += sizeof(*tmp);
 	return tmp;
 }
 
@@ -84,38 +144,74 @@ zone_popz(zone *z)
 		exit(-1);
 	}
 
-	/* Release all chunks before losing access to them. */
-
+	/* Release all chunks, the last one holds the zone itself */
+	next = z->next;
 	cp = z->chunk;
 	while (cp) {
 		struct chunk *garbage;
 			
 		garbage = cp;
 		cp = cp->next;
-		free(garbage);
+		rmchunk(garbage);
 	}
-
-	next = z->next;
-	free(z);
 	return next;
 }
 
 void *
 zone_allocz(zone *z, size_t n)
 {
-	/* Align to 32 bytes */
-	n = (n + 31) & ~31;
+	return zone_alignedz(z, n, ZONE_ALIGN);
+}
+
+void *
+zone_alignedz(zone *z, size_t n, size_t align)
+{
+	struct chunk *c = z->chunk;
+	uintptr_t p = (uintptr_t)c->bytes + c->sp - n;
 
-	if (n > z->chunk->sp) {
+	/* Allocations grow down from the end of the chunk */
+	p &= ~(uintptr_t)(align - 1);
+	if (n > c->sp || p < (uintptr_t)c->bytes) {
 		struct chunk *tmp;
 
-		tmp = mkchunk(max(n, CHUNK_SIZE), z->chunk);
+		tmp = mkchunk(n + align, z->chunk);
 		if (!tmp) {
 			return NULL;
 		}
-		z->chunk = tmp;
+		stats.wasted += c->sp;
+		z->chunk = c = tmp;
+		p = ((uintptr_t)c->bytes + c->sp - n) & ~(uintptr_t)(align - 1);
 	}
 
-	z->chunk->sp -= n;
-	return &z->chunk->bytes[z->chunk->sp];
+	stats.requested += n;
+	stats.wasted += (uintptr_t)c->bytes + c->sp - p - n;
+	c->sp = p - (uintptr_t)c->bytes;
+	return (void *)p;
+}
+
+zone_pos
+zone_markz(zone *z)
+{
+	zone_pos m = {z->chunk, z->chunk->sp};
+
+	return m;
+}
+
+void
+zone_rewindz(zone *z, zone_pos m)
+{
+	struct chunk *garbage;
+
+	while (z->chunk != m.chunk) {
+		garbage = z->chunk;
+		z->chunk = garbage->next;
+		rmchunk(garbage);
+	}
+	z->chunk->sp = m.sp;
+}
+
+struct zone_stats
+zone_stats(void)
+{
+	return stats;
 }
@@ -2,12 +2,34 @@
 #ifndef ZONE_H__
 #define ZONE_H__
 
+#include <stdint.h>
 #include <stdlib.h>
 
+/* Alignment of zone_alloc and zone_allocz */
+#define ZONE_ALIGN 16
+
 typedef struct zone zone;
 
+/* A point in a zone to rewind to, from zone_mark or zone_markz */
+typedef struct zone_pos {
+	struct chunk *chunk;
+	size_t sp;
+} zone_pos;
+
+/* Allocation counters of the calling thread */
+struct zone_stats {
+	uint64_t requested; /* Bytes asked for so far */
+	uint64_t wasted;    /* Bytes lost to alignment and chunk tails so far */
+	uint64_t retained;  /* Bytes of chunks held, in zones or for reuse */
+	uint64_t chunks;    /* Chunks held, in zones or for reuse */
+	uint64_t mallocs;   /* Chunks taken from malloc */
+};
+
 /*
- * zone_push pushes a new region onto the global region stack
+ * zone_push pushes a new region onto the region stack of the calling
+ * thread. Popped and rewound chunks are kept for reuse by the thread, so
+ * pushing and popping in steady state does not call malloc. Zones are
+ * popped by the thread that pushed them. Memory from zones is not zeroed.
  */
 void
 zone_push();
@@ -18,6 +40,17 @@ zone_pop();
 void *
 zone_alloc(size_t n);
 
+/* Allocate n bytes aligned to align, a power of two */
+void *
+zone_aligned(size_t n, size_t align);
+
+zone_pos
+zone_mark();
+
+/* Release everything allocated from the top zone since m */
+void
+zone_rewind(zone_pos m);
+
 zone *
 zone_pushz(zone *z);
 
@@ -27,4 +60,16 @@ zone_popz(zone *z);
 void *
 zone_allocz(zone *z, size_t n);
 
+void *
+zone_alignedz(zone *z, size_t n, size_t align);
+
+zone_pos
+zone_markz(zone *z);
+
+void
+zone_rewindz(zone *z, zone_pos m);
+
+struct zone_stats
+zone_stats(void);
+
 #endif